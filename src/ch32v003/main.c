@@ -41,6 +41,9 @@ static uint8_t newByte = 0;
 
 static zf_result r;
 
+// Dictionary addresses taken by the core in flash, which uses no RAM
+static int rom_offset = 0;
+
 static void print_result(zf_result r);
 
 void handle_debug_input(int numbytes, uint8_t *data)
@@ -75,23 +78,35 @@ static int bytes_used(void)
 {
     zf_cell here = 0;
     (void)zf_uservar_get(ZF_USERVAR_HERE, &here);
-    return here;
+    return here - rom_offset;
 }
 
-static void load_core(void)
+// Read a byte of the dictionary. zf_dump() only returns the RAM part once the
+// core is mapped from flash, which holds the user variables and the words
+// defined after the core
+static uint8_t dict_byte(zf_addr addr)
 {
-    size_t dict_len = 0;
-    char *const dict_base = zf_dump(&dict_len);
-    if (dict_len < sizeof(core_gen_str))
+    const uint8_t *ram = zf_dump(NULL);
+    if (rom_offset > 0 && addr >= ZF_USERVAR_COUNT * sizeof(zf_addr))
     {
-        puts("ERROR: core dictionary too big");
-        return;
+        if (addr < sizeof(core_gen_str))
+        {
+            return core_gen_str[addr];
+        }
+        addr -= rom_offset;
     }
+    return ram[addr];
+}
 
-    for (size_t i = 0; i < sizeof(core_gen_str); i++)
+static void load_core(void)
+{
+    // The core is executed in place from flash
+    if (zf_map_rom(core_gen_str, sizeof(core_gen_str)) != ZF_OK)
     {
-        dict_base[i] = core_gen_str[i];
+        puts("ERROR: core dictionary too big");
+        return;
     }
+    rom_offset = sizeof(core_gen_str) - ZF_USERVAR_COUNT * sizeof(zf_addr);
 
     puts("OK");
 }
@@ -188,12 +203,16 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
         case ZF_SYSCALL_TELL:
             zf_cell len = zf_pop();
             zf_cell addr = zf_pop();
-            if (addr >= ZF_DICT_SIZE - len)
+            size_t ram_size;
+            (void)zf_dump(&ram_size);
+            if (len < 0 || addr < 0 || (size_t)addr + len > ram_size + rom_offset)
             {
                 zf_abort(ZF_ABORT_OUTSIDE_MEM);
             }
-            void *buf = (uint8_t *)zf_dump(NULL) + (int)addr;
-            (void)_write(1, buf, len);
+            for (zf_cell i = 0; i < len; i++)
+            {
+                putchar(dict_byte(addr + i));
+            }
             putchar('\n');
             break;
         default:
@@ -370,6 +389,9 @@ static void print_result(zf_result r)
         case ZF_ABORT_EXTERNAL:
             msg = "EXTERNAL";
             break;
+        case ZF_YIELD:
+            msg = "YIELD";
+            break;
     }
     puts(msg);
 }
@@ -28,6 +28,35 @@
 
 #define ZF_ENABLE_TYPED_MEM_ACCESS 1
 
+/* Optional features, see src/linux/zfconf.h for what each of them does and
+ * costs. The ones which add primitives (FUSION, AOT, INLINE, TASKS and
+ * CHANNELS) have to match src/z4c/zfconf.h, which builds the core image */
+
+#define ZF_ENABLE_ROM 1
+#define ZF_ROM_SIZE 2048
+#define ZF_ENABLE_COMPUTED_GOTO 0
+#define ZF_ENABLE_DECODE_CACHE 0
+#define ZF_ENABLE_TOS_CACHE 0
+#define ZF_ENABLE_FUSION 0
+#define ZF_ENABLE_WORD_HASH 0
+#define ZF_ENABLE_VERIFY 0
+#define ZF_ENABLE_AOT 1
+#define ZF_ENABLE_INLINE 0
+#define ZF_INLINE_SIZE 0
+#define ZF_ENABLE_TASKS 0
+#define ZF_TASKS_MAX 4
+#define ZF_ENABLE_YIELD 0
+#define ZF_ENABLE_CHANNELS 0
+#define ZF_ENABLE_PARSE_NUM 0
+
+/* Threads, and features which need a POSIX host */
+
+#define ZF_THREAD_LOCAL
+#define ZF_ENABLE_JIT 0
+#define ZF_ENABLE_BATCH 0
+#define ZF_ENABLE_SNAPSHOT 0
+#define ZF_ENABLE_PARALLEL 0
+
 /* Type to use for the basic cell, data stack and return stack. Choose a signed
  * integer type that suits your needs, or 'float' or 'double' if you need
  * floating point numbers */
@@ -6,6 +6,15 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #ifdef USE_READLINE
 #include <readline/readline.h>
@@ -15,16 +24,103 @@
 #include "zforth.h"
 
 
+/*
+ * Output of the current thread. Pool workers collect the output of a job
+ * here and write it in one piece when the job is done
+ */
+
+static __thread FILE *out;
+
 
 /*
- * Evaluate buffer with code, check return value and report errors
+ * Buffered standard output. Output is collected until a newline is written,
+ * input is read, something is written to stderr, or 'flush' is called, and
+ * then written with a single writev() together with the new data, so that
+ * slices of the dictionary do not have to be copied. The buffer is shared
+ * by all threads without an output stream of their own, like the ones
+ * running pmap and preduce, so it is locked
  */
 
-zf_result do_eval(const char *src, int line, const char *buf)
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static char out_buf[4096];
+static size_t out_len;
+
+static void write_all(struct iovec *iov, int n)
 {
-	const char *msg = NULL;
+	while(n > 0) {
+		ssize_t r = writev(STDOUT_FILENO, iov, n);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		while(n > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
 
-	zf_result rv = zf_eval(buf);
+static void flush_output(void)
+{
+	struct iovec iov;
+	if(out) return;
+	pthread_mutex_lock(&out_lock);
+	iov.iov_base = out_buf;
+	iov.iov_len = out_len;
+	if(out_len > 0) write_all(&iov, 1);
+	out_len = 0;
+	pthread_mutex_unlock(&out_lock);
+}
+
+static void write_output(const void *buf, size_t len)
+{
+	struct iovec iov[2];
+
+	if(out) {
+		fwrite(buf, 1, len, out);
+		return;
+	}
+	pthread_mutex_lock(&out_lock);
+	if(out_len + len <= sizeof(out_buf) && memchr(buf, '\n', len) == NULL) {
+		memcpy(out_buf + out_len, buf, len);
+		out_len += len;
+	} else {
+		iov[0].iov_base = out_buf;
+		iov[0].iov_len = out_len;
+		iov[1].iov_base = (void *)buf;
+		iov[1].iov_len = len;
+		write_all(iov, 2);
+		out_len = 0;
+	}
+	pthread_mutex_unlock(&out_lock);
+}
+
+static void print_output(const char *fmt, ...)
+{
+	char buf[128];
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	if(n > 0) write_output(buf, n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+
+/*
+ * Check return value of an evaluation and report errors, with the position of
+ * the word which caused them if the column is known
+ */
+
+static zf_result report(const char *src, int line, int col, zf_result rv)
+{
+	const char *msg = NULL;
 
 	switch(rv)
 	{
@@ -39,12 +135,15 @@ zf_result do_eval(const char *src, int line, const char *buf)
 		case ZF_ABORT_COMPILE_ONLY_WORD: msg = "compile-only word"; break;
 		case ZF_ABORT_INVALID_SIZE: msg = "invalid size"; break;
 		case ZF_ABORT_DIVISION_BY_ZERO: msg = "division by zero"; break;
+		case ZF_YIELD: msg = "waiting for a channel"; break;
 		default: msg = "unknown error";
 	}
 
 	if(msg) {
+		flush_output();
 		fprintf(stderr, "\033[31m");
-		if(src) fprintf(stderr, "%s:%d: ", src, line);
+		if(src && col > 0) fprintf(stderr, "%s:%d:%d: ", src, line, col);
+		else if(src) fprintf(stderr, "%s:%d: ", src, line);
 		fprintf(stderr, "%s\033[0m\n", msg);
 	}
 
@@ -53,23 +152,273 @@ zf_result do_eval(const char *src, int line, const char *buf)
 
 
 /*
- * Load given forth file
+ * Evaluate buffer with code, check return value and report errors. The buffer
+ * starts at the given line. The position of an error is found from the offset
+ * where the evaluation stopped; the rest of that line is skipped and the
+ * evaluation goes on with the next line. Returns the first error
  */
 
-void include(const char *fname)
+zf_result do_eval(const char *src, int line, const char *buf, size_t len)
 {
-	char buf[256];
+	zf_result rv = ZF_OK;
+	size_t off = 0;
 
-	FILE *f = fopen(fname, "rb");
-	int line = 1;
-	if(f) {
-		while(fgets(buf, sizeof(buf), f)) {
-			do_eval(fname, line++, buf);
+	while(off < len) {
+		size_t end;
+		int col = 1;
+		zf_result r = zf_eval_n(buf + off, len - off);
+
+		if(rv == ZF_OK) rv = r;
+		if(r == ZF_OK || r == ZF_YIELD) {
+			report(src, line, 0, r);
+			break;
 		}
-		fclose(f);
-	} else {
+
+		end = off + zf_eval_pos();
+		for(; off<end; off++) {
+			if(buf[off] == '\n') {
+				line++;
+				col = 1;
+			} else {
+				col++;
+			}
+		}
+		report(src, line, col, r);
+
+		while(off < len && buf[off] != '\n') off++;
+		off++;
+		line++;
+	}
+
+	return rv;
+}
+
+
+/*
+ * Cache of compiled files. Including a file which only adds to the dictionary
+ * always has the same result for the same source, dictionary and data stack,
+ * so the part of the dictionary it changed is stored in the cache directory
+ * under a hash of all three, and written back on the next include instead of
+ * evaluating the file again. Files which use syscalls with effects outside
+ * the dictionary, like output or including other files, are not cached; the
+ * flag for that is shared by all threads, since pmap and preduce run words
+ * on threads of their own. The key also covers the cell and address types
+ * of the build and the options which change the code the compiler generates.
+ * The numbering of the primitives is covered by the hash of the dictionary,
+ * which starts with their entries
+ */
+
+struct cache_entry {
+	char magic[4];
+	uint32_t start;
+	uint32_t len;
+};
+
+static const char *cache_dir;
+static atomic_int cache_dirty;
+
+static uint64_t hash(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while(len--) {
+		h = (h ^ *p++) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+static uint64_t stack_hash(void)
+{
+	zf_cell depth, v;
+	zf_addr i;
+	char build[128];
+	uint64_t h;
+
+	snprintf(build, sizeof(build), "zfc2 %zu %zu %d %d %d %d %d %d %d %d %d",
+	         sizeof(zf_cell), sizeof(zf_addr), (zf_cell)0.5 != 0, ZF_DICT_SIZE,
+	         ZF_ENABLE_TYPED_MEM_ACCESS, ZF_ENABLE_FUSION, ZF_ENABLE_JIT, ZF_ENABLE_AOT,
+	         ZF_ENABLE_INLINE, ZF_INLINE_SIZE, ZF_ENABLE_TASKS);
+	h = hash(0xcbf29ce484222325ull, build, strlen(build));
+
+	zf_uservar_get(ZF_USERVAR_DSP, &depth);
+	h = hash(h, &depth, sizeof(depth));
+	for(i=0; i<(zf_addr)depth; i++) {
+		zf_ctx_pick(zf_ctx_current(), i, &v);
+		h = hash(h, &v, sizeof(v));
+	}
+	return h;
+}
+
+static int cache_load(const char *path)
+{
+	struct cache_entry e;
+	size_t len;
+	uint8_t *dict = zf_dump(&len);
+	void *buf;
+	int ok = 0;
+
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) return 0;
+	if(fread(&e, sizeof(e), 1, f) == 1 && memcmp(e.magic, "zfc2", 4) == 0 &&
+	   e.start <= ZF_DICT_SIZE && e.len <= ZF_DICT_SIZE - e.start) {
+		buf = malloc(e.len + 1);
+		if(buf && fread(buf, 1, e.len, f) == e.len && fgetc(f) == EOF) {
+			memcpy(dict + e.start, buf, e.len);
+			zf_dict_changed();
+			ok = 1;
+		}
+		free(buf);
+	}
+	fclose(f);
+	return ok;
+}
+
+static void cache_store(const char *path, const uint8_t *prev, size_t prev_len)
+{
+	struct cache_entry e = { { 'z', 'f', 'c', '2' }, 0, 0 };
+	size_t len;
+	const uint8_t *dict = zf_dump(&len);
+	char *tmp = malloc(strlen(path) + 8);
+	FILE *f;
+	int fd;
+
+	while(e.start < len && e.start < prev_len && dict[e.start] == prev[e.start]) e.start++;
+	e.len = len - e.start;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if(fd >= 0) {
+		f = fdopen(fd, "wb");
+		if(f && fwrite(&e, sizeof(e), 1, f) == 1 && fwrite(dict + e.start, 1, e.len, f) == e.len &&
+		   fclose(f) == 0) {
+			rename(tmp, path);
+		} else {
+			unlink(tmp);
+		}
+	}
+	free(tmp);
+}
+
+
+/*
+ * Evaluate a file through the cache
+ */
+
+static void include_cached(const char *fname, const char *buf, size_t len)
+{
+	uint64_t stack = stack_hash();
+	uint64_t h = hash(hash(stack, buf, len), &len, sizeof(len));
+	size_t dict_len;
+	const void *dict = zf_dump(&dict_len);
+	char *path = malloc(strlen(cache_dir) + 40);
+	void *prev = malloc(dict_len);
+	int dirty = cache_dirty;
+	zf_result rv;
+
+	sprintf(path, "%s/%016llx.zfc", cache_dir, (unsigned long long)hash(h, dict, dict_len));
+	memcpy(prev, dict, dict_len);
+
+	if(!cache_load(path)) {
+		cache_dirty = 0;
+		rv = do_eval(fname, 1, buf, len);
+		if(rv == ZF_OK && !cache_dirty && stack_hash() == stack) {
+			cache_store(path, prev, dict_len);
+		}
+		cache_dirty = dirty;
+	}
+
+	free(prev);
+	free(path);
+}
+
+
+/*
+ * Read all of a file which can not be mapped, such as a pipe, into a
+ * growing buffer
+ */
+
+static char *read_all(int fd, size_t *len)
+{
+	size_t size = 4096;
+	char *buf = malloc(size), *nbuf;
+	ssize_t n;
+
+	*len = 0;
+	while(buf) {
+		if(*len == size) {
+			nbuf = realloc(buf, size * 2);
+			if(!nbuf) {
+				break;
+			}
+			buf = nbuf;
+			size *= 2;
+		}
+		n = read(fd, buf + *len, size - *len);
+		if(n == 0) {
+			return buf;
+		}
+		if(n < 0 && errno != EINTR) {
+			break;
+		}
+		if(n > 0) {
+			*len += n;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/*
+ * Load given forth file. The file is mapped and evaluated in one piece, so
+ * words and strings may span lines and are never split by a buffer. Files
+ * which can not be mapped are read instead. Only files included between
+ * evaluations go through the cache, since a cache hit rebuilds the tables of
+ * the dictionary, which running words may rely on
+ */
+
+void include(const char *name, int cached)
+{
+	struct stat st;
+	zf_cell trace;
+	void *p = MAP_FAILED;
+	char *buf = NULL;
+	size_t len = 0;
+
+	/* The name may be in the token buffer of the interpreter, which is
+	 * reused while the file is evaluated */
+
+	char *fname = strdup(name);
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0) {
 		fprintf(stderr, "error opening file '%s': %s\n", fname, strerror(errno));
+		free(fname);
+		return;
+	}
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		len = st.st_size;
+		p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if(p == MAP_FAILED) {
+		buf = read_all(fd, &len);
+		p = buf;
+	}
+	if(p == NULL) {
+		fprintf(stderr, "error reading file '%s': %s\n", fname, strerror(errno));
+	} else {
+		zf_uservar_get(ZF_USERVAR_TRACE, &trace);
+		if(cached && cache_dir && !trace) {
+			include_cached(fname, p, len);
+		} else {
+			do_eval(fname, 1, p, len);
+		}
+		if(buf) {
+			free(buf);
+		} else {
+			munmap(p, len);
+		}
 	}
+	close(fd);
+	free(fname);
 }
 
 
@@ -101,6 +450,7 @@ static void load(const char *fname)
 	if(f) {
 		fread(p, 1, len, f);
 		fclose(f);
+		zf_dict_changed();
 	} else {
 		perror("read");
 	}
@@ -111,20 +461,31 @@ static void load(const char *fname)
  * Sys callback function
  */
 
+#if ZF_ENABLE_PARALLEL
+static int nprocs = 1;
+#endif
+
 zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
 {
+	/* Only sin, pmap and preduce leave no trace outside the dictionary, so
+	 * files using other syscalls can not be cached */
+
+	if(id != ZF_SYSCALL_USER + 1 && id != ZF_SYSCALL_USER + 4 && id != ZF_SYSCALL_USER + 5) {
+		cache_dirty = 1;
+	}
+
 	switch((int)id) {
 
 
 		/* The core system callbacks */
 
-		case ZF_SYSCALL_EMIT:
-			putchar((char)zf_pop());
-			fflush(stdout);
+		case ZF_SYSCALL_EMIT: {
+			char c = (char)zf_pop();
+			write_output(&c, 1); }
 			break;
 
 		case ZF_SYSCALL_PRINT:
-			printf(ZF_CELL_FMT " ", zf_pop());
+			print_output(ZF_CELL_FMT " ", zf_pop());
 			break;
 
 		case ZF_SYSCALL_TELL: {
@@ -134,15 +495,14 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
 				zf_abort(ZF_ABORT_OUTSIDE_MEM);
 			}
 			void *buf = (uint8_t *)zf_dump(NULL) + (int)addr;
-			(void)fwrite(buf, 1, len, stdout);
-			fflush(stdout); }
+			write_output(buf, len); }
 			break;
 
 
 		/* Application specific callbacks */
 
 		case ZF_SYSCALL_USER + 0:
-			printf("\n");
+			write_output("\n", 1);
 			exit(0);
 			break;
 
@@ -154,15 +514,42 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
 			if(input == NULL) {
 				return ZF_INPUT_PASS_WORD;
 			}
-			include(input);
+			include(input, 0);
 			break;
 		
 		case ZF_SYSCALL_USER + 3:
 			save("zforth.save");
 			break;
 
+#if ZF_ENABLE_PARALLEL
+		case ZF_SYSCALL_USER + 4:
+		case ZF_SYSCALL_USER + 5: {
+			zf_addr count = zf_pop();
+			zf_addr size = zf_pop();
+			zf_addr addr = zf_pop();
+			zf_addr xt = zf_pop();
+			zf_cell v;
+			/* Pool jobs already keep every processor busy, and the word
+			 * has to write to the output stream of the job */
+			int n = out ? 1 : nprocs;
+			zf_result r = (id == ZF_SYSCALL_USER + 4) ?
+				zf_pmap(xt, addr, size, count, n) :
+				zf_preduce(xt, addr, size, count, n, &v);
+			if(r != ZF_OK) {
+				zf_abort(r);
+			}
+			if(id == ZF_SYSCALL_USER + 5) {
+				zf_push(v);
+			} }
+			break;
+#endif
+
+		case ZF_SYSCALL_USER + 6:
+			flush_output();
+			break;
+
 		default:
-			printf("unhandled syscall %d\n", id);
+			print_output("unhandled syscall %d\n", id);
 			break;
 	}
 
@@ -170,12 +557,305 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
 }
 
 
+/*
+ * Channels: ZF_CHANNELS_MAX channels are attached to the context, and so to
+ * all pool jobs forked from it, which can pass values to each other while
+ * they run. A job waiting for a channel yields, and its worker resumes it
+ * after giving the other threads a chance to run
+ */
+
+#if ZF_ENABLE_CHANNELS
+
+#define CHANNEL_SIZE 64
+
+static zf_chan *channels[ZF_CHANNELS_MAX];
+
+static void channels_init(void)
+{
+	int i;
+
+	for(i=0; i<ZF_CHANNELS_MAX; i++) {
+		channels[i] = malloc(zf_chan_size(CHANNEL_SIZE));
+		zf_chan_init(channels[i], CHANNEL_SIZE);
+		zf_chan_attach(i, channels[i]);
+	}
+}
+
+#endif
+
+
+/*
+ * Thread pool: every line from stdin is a job, which is evaluated by one of
+ * the worker threads in a context of its own, forked from a snapshot of the
+ * context built by the files from the command line. The forks share the
+ * memory of the snapshot until a job writes to it, so a job only pays for
+ * the pages it modifies. Without snapshots, the dictionary is written to a
+ * file once instead, and every job maps the file privately, which shares the
+ * pages the same way. stdin is the job queue, and the output of every job
+ * is written in one piece when the job is done.
+ */
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool_line;
+
+#if ZF_ENABLE_SNAPSHOT
+
+static zf_snapshot *pool_snapshot;
+
+static void pool_setup(void)
+{
+	pool_snapshot = zf_snapshot_take();
+	if(pool_snapshot == NULL) {
+		perror("zf_snapshot");
+		exit(1);
+	}
+}
+
+static void pool_teardown(void)
+{
+	zf_snapshot_release(pool_snapshot);
+}
+
+static zf_ctx *pool_fork(void)
+{
+	return zf_fork(pool_snapshot);
+}
+
+static void pool_release(zf_ctx *ctx)
+{
+	zf_fork_release(ctx);
+}
+
+#else
+
+static FILE *pool_file;
+static zf_cell pool_here;
+static zf_cell pool_latest;
+static zf_cell pool_trace;
+static __thread zf_cell pool_dstack[ZF_DSTACK_SIZE + ZF_ENABLE_TOS_CACHE];
+static __thread zf_cell pool_rstack[ZF_RSTACK_SIZE];
+static __thread void *pool_dict;
+
+static void pool_setup(void)
+{
+	size_t len;
+	void *p = zf_dump(&len);
+
+	pool_file = tmpfile();
+	if(pool_file == NULL || fwrite(p, 1, len, pool_file) != len || fflush(pool_file) != 0) {
+		perror("tmpfile");
+		exit(1);
+	}
+	zf_uservar_get(ZF_USERVAR_HERE, &pool_here);
+	zf_uservar_get(ZF_USERVAR_LATEST, &pool_latest);
+	zf_uservar_get(ZF_USERVAR_TRACE, &pool_trace);
+}
+
+static void pool_teardown(void)
+{
+	fclose(pool_file);
+}
+
+static zf_ctx *pool_fork(void)
+{
+	zf_ctx *ctx = malloc(zf_ctx_size());
+
+	pool_dict = mmap(NULL, ZF_DICT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(pool_file), 0);
+	if(ctx == NULL || pool_dict == MAP_FAILED) {
+		if(pool_dict != MAP_FAILED) munmap(pool_dict, ZF_DICT_SIZE);
+		free(ctx);
+		return NULL;
+	}
+
+	zf_ctx_init(ctx, pool_dict, ZF_DICT_SIZE, pool_dstack, ZF_DSTACK_SIZE + ZF_ENABLE_TOS_CACHE,
+			pool_rstack, ZF_RSTACK_SIZE, pool_trace);
+	zf_ctx_uservar_set(ctx, ZF_USERVAR_HERE, pool_here);
+	zf_ctx_uservar_set(ctx, ZF_USERVAR_LATEST, pool_latest);
+	zf_ctx_dict_changed(ctx);
+	return ctx;
+}
+
+static void pool_release(zf_ctx *ctx)
+{
+	zf_ctx_release(ctx);
+	free(ctx);
+	munmap(pool_dict, ZF_DICT_SIZE);
+}
+
+#endif
+
+static void *pool_worker(void *arg)
+{
+	char *buf = NULL;
+	size_t size = 0;
+
+	for(;;) {
+		char *obuf;
+		size_t olen;
+		zf_ctx *ctx;
+		ssize_t len;
+		zf_result rv;
+		int line;
+
+		pthread_mutex_lock(&pool_lock);
+		len = getline(&buf, &size, stdin);
+		line = ++pool_line;
+		pthread_mutex_unlock(&pool_lock);
+		if(len < 0) break;
+
+		ctx = pool_fork();
+		if(ctx == NULL) {
+			perror("pool_fork");
+			break;
+		}
+
+		out = open_memstream(&obuf, &olen);
+		rv = zf_ctx_eval(ctx, buf);
+#if ZF_ENABLE_CHANNELS
+		while(rv == ZF_YIELD) {
+			sched_yield();
+			rv = zf_ctx_run_steps(ctx, NULL, 0);
+		}
+#endif
+		report("stdin", line, 0, rv);
+		fclose(out);
+		out = NULL;
+
+		pthread_mutex_lock(&pool_lock);
+		write_output(obuf, olen);
+		write_output("\n", 1);
+		pthread_mutex_unlock(&pool_lock);
+
+		free(obuf);
+		pool_release(ctx);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void pool(int n)
+{
+	pthread_t *threads = malloc(n * sizeof(pthread_t));
+	int i;
+
+	pool_setup();
+	for(i=0; i<n; i++) {
+		pthread_create(&threads[i], NULL, pool_worker, NULL);
+	}
+	for(i=0; i<n; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pool_teardown();
+	free(threads);
+}
+
+
+#if ZF_ENABLE_BATCH
+
+/*
+ * Batch mode: every line from stdin is a job, and all jobs are run at once
+ * with zf_eval_batch() on N threads. The first thread uses the context built
+ * by the files from the command line, the others a copy of it. The data
+ * stack left by every job is printed in the order of the jobs; what the jobs
+ * write themselves is printed as they run.
+ */
+
+typedef struct {
+	zf_cell dstack[ZF_DSTACK_SIZE + ZF_ENABLE_TOS_CACHE];
+	zf_cell rstack[ZF_RSTACK_SIZE];
+	uint8_t dict[ZF_DICT_SIZE];
+} batch_mem;
+
+static void batch(int n)
+{
+	zf_ctx **ctxs = calloc(n, sizeof(zf_ctx *));
+	batch_mem *mem = calloc(n, sizeof(batch_mem));
+	zf_cell (*outs)[ZF_DSTACK_SIZE] = NULL;
+	zf_job *jobs = NULL;
+	char **lines = NULL;
+	char *buf = NULL;
+	size_t size = 0, count = 0, len, i;
+	zf_addr j;
+	zf_cell trace;
+	void *dict = zf_dump(&len);
+
+	if(ctxs == NULL || mem == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	while(getline(&buf, &size, stdin) >= 0) {
+		lines = realloc(lines, (count + 1) * sizeof(char *));
+		if(lines == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		lines[count++] = buf;
+		buf = NULL;
+		size = 0;
+	}
+	free(buf);
+
+	jobs = calloc(count + 1, sizeof(zf_job));
+	outs = calloc(count + 1, sizeof(*outs));
+	if(jobs == NULL || outs == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for(i=0; i<count; i++) {
+		jobs[i].src = lines[i];
+		jobs[i].out = outs[i];
+		jobs[i].out_size = ZF_DSTACK_SIZE;
+	}
+
+	zf_uservar_get(ZF_USERVAR_TRACE, &trace);
+	ctxs[0] = zf_ctx_current();
+	for(i=1; i<(size_t)n; i++) {
+		ctxs[i] = malloc(zf_ctx_size());
+		if(ctxs[i] == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		zf_ctx_init(ctxs[i], mem[i].dict, ZF_DICT_SIZE, mem[i].dstack, ZF_DSTACK_SIZE + ZF_ENABLE_TOS_CACHE,
+				mem[i].rstack, ZF_RSTACK_SIZE, trace);
+		memcpy(mem[i].dict, dict, len);
+		zf_ctx_dict_changed(ctxs[i]);
+	}
+
+	zf_eval_batch(ctxs, n, jobs, count);
+
+	for(i=0; i<count; i++) {
+		for(j=0; j<jobs[i].out_count; j++) {
+			print_output(ZF_CELL_FMT " ", jobs[i].out[j]);
+		}
+		report("stdin", i + 1, 0, jobs[i].result);
+		write_output("\n", 1);
+		free(lines[i]);
+	}
+
+	for(i=1; i<(size_t)n; i++) {
+		zf_ctx_release(ctxs[i]);
+		free(ctxs[i]);
+	}
+	free(lines);
+	free(jobs);
+	free(outs);
+	free(mem);
+	free(ctxs);
+}
+
+#endif
+
+
 /*
  * Tracing output
  */
 
 void zf_host_trace(const char *fmt, va_list va)
 {
+	flush_output();
 	fprintf(stderr, "\033[1;30m");
 	vfprintf(stderr, fmt, va);
 	fprintf(stderr, "\033[0m");
@@ -208,6 +888,11 @@ void usage(void)
 		"   -t         enable tracing\n"
 		"   -l FILE    load dictionary from FILE\n"
 		"   -q         quiet\n"
+		"   -p N       evaluate every line from stdin as a separate job on N threads\n"
+#if ZF_ENABLE_BATCH
+		"   -b N       evaluate all lines from stdin as a batch of jobs on N threads\n"
+#endif
+		"   -C DIR     cache compiled files in DIR\n"
 	);
 }
 
@@ -223,11 +908,15 @@ int main(int argc, char **argv)
 	int trace = 0;
 	int line = 0;
 	int quiet = 0;
+	int threads = 0;
+#if ZF_ENABLE_BATCH
+	int batch_threads = 0;
+#endif
 	const char *fname_load = NULL;
 
 	/* Parse command line options */
 
-	while((c = getopt(argc, argv, "hl:tq")) != -1) {
+	while((c = getopt(argc, argv, "hl:tqp:b:C:")) != -1) {
 		switch(c) {
 			case 't':
 				trace = 1;
@@ -241,6 +930,18 @@ int main(int argc, char **argv)
 			case 'q':
 				quiet = 1;
 				break;
+			case 'p':
+				threads = atoi(optarg);
+				break;
+#if ZF_ENABLE_BATCH
+			case 'b':
+				batch_threads = atoi(optarg);
+				break;
+#endif
+			case 'C':
+				cache_dir = optarg;
+				mkdir(cache_dir, 0777);
+				break;
 		}
 	}
 	
@@ -251,6 +952,14 @@ int main(int argc, char **argv)
 	/* Initialize zforth */
 
 	zf_init(trace);
+	atexit(flush_output);
+
+#if ZF_ENABLE_CHANNELS
+	channels_init();
+#endif
+#if ZF_ENABLE_PARALLEL
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
 
 	/* Load dict from disk if requested, otherwise bootstrap fort
@@ -266,15 +975,27 @@ int main(int argc, char **argv)
 	/* Include files from command line */
 
 	for(i=0; i<argc; i++) {
-		include(argv[i]);
+		include(argv[i], 1);
 	}
 
 	if(!quiet) {
 		zf_cell here;
 		zf_uservar_get(ZF_USERVAR_HERE, &here);
-		printf("Welcome to zForth, %d bytes used\n", (int)here);
+		print_output("Welcome to zForth, %d bytes used\n", (int)here);
+	}
+
+	if(threads > 0) {
+		pool(threads);
+		return 0;
 	}
 
+#if ZF_ENABLE_BATCH
+	if(batch_threads > 0) {
+		batch(batch_threads);
+		return 0;
+	}
+#endif
+
 	/* Interactive interpreter: read a line using readline library,
 	 * and pass to zf_eval() for evaluation*/
 
@@ -284,13 +1005,16 @@ int main(int argc, char **argv)
 
 	for(;;) {
 
-		char *buf = readline("");
+		char *buf;
+
+		flush_output();
+		buf = readline("");
 		if(buf == NULL) break;
 
 		if(strlen(buf) > 0) {
 
-			do_eval("stdin", ++line, buf);
-			printf("\n");
+			do_eval("stdin", ++line, buf, strlen(buf));
+			write_output("\n", 1);
 
 			add_history(buf);
 			write_history(".zforth.hist");
@@ -302,9 +1026,10 @@ int main(int argc, char **argv)
 #else
 	for(;;) {
 		char buf[4096];
+		flush_output();
 		if(fgets(buf, sizeof(buf), stdin)) {
-			do_eval("stdin", ++line, buf);
-			printf("\n");
+			do_eval("stdin", ++line, buf, strlen(buf));
+			write_output("\n", 1);
 		} else {
 			break;
 		}
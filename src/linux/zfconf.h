@@ -24,6 +24,14 @@
 #define ZF_ENABLE_BOOTSTRAP 1
 
 
+/* Set to 1 to run a cross-compiled dictionary image in place from read-only
+ * memory with zf_map_rom(), instead of copying it into the dictionary.
+ * Only the words defined after the image take RAM. ZF_ROM_SIZE is the
+ * largest image in bytes. Adds a check to every dictionary access */
+
+#define ZF_ENABLE_ROM 0
+
+
 /* Set to 1 to enable typed access to memory. This allows memory read and write 
  * of signed and unsigned memory of 8, 16 and 32 bits width, as well as the zf_cell 
  * type. This adds a few hundred bytes of .text. Check the memaccess.zf file for
@@ -32,6 +40,174 @@
 #define ZF_ENABLE_TYPED_MEM_ACCESS 1
 
 
+/* Set to 1 to dispatch primitives through a table of label addresses instead
+ * of a switch statement. This requires the 'labels as values' extension found
+ * in GCC and clang, and trades a few hundred bytes of .text for a noticeably
+ * faster inner interpreter */
+
+#define ZF_ENABLE_COMPUTED_GOTO 1
+
+
+/* Set to 1 to keep a cache of decoded instructions, so the variable length
+ * cells in the dictionary do not have to be decoded every time they are
+ * executed. ZF_DECODE_CACHE_SIZE is the number of cache records and must be a
+ * power of two; each record takes three zf_addr and one zf_cell of RAM */
+
+#define ZF_ENABLE_DECODE_CACHE 1
+#define ZF_DECODE_CACHE_SIZE 1024
+
+
+/* Set to 1 to keep the top of the data stack and both stack pointers in local
+ * variables while the inner interpreter runs, instead of going through memory
+ * for every stack operation. Adds some .text, but makes arithmetic and stack
+ * heavy words considerably faster */
+
+#define ZF_ENABLE_TOS_CACHE 1
+
+
+/* Set to 1 to fuse common pairs of instructions into superinstructions when a
+ * definition is closed with ';', saving one dispatch per fused pair. This adds
+ * primitives, so dictionary images are only compatible between builds with
+ * the same setting */
+
+#define ZF_ENABLE_FUSION 1
+
+
+/* Set to 1 to keep a hash index of the dictionary for looking up words by
+ * name, instead of walking the whole dictionary for every word. The index
+ * takes ZF_WORD_HASH_SIZE zf_addr of RAM; the size must be a power of two and
+ * should be well above the number of words in the dictionary */
+
+#define ZF_ENABLE_WORD_HASH 1
+#define ZF_WORD_HASH_SIZE 512
+
+
+/* Set to 1 to verify the stack effect of words when they are defined. Words
+ * which are proven not to overrun or underrun the stacks run without stack
+ * checks, after a single check of the stack depths when they are called.
+ * ZF_VERIFY_SIZE is the number of words whose results are kept and must be a
+ * power of two; each entry takes one zf_addr and four bytes of RAM. Requires
+ * ZF_ENABLE_TOS_CACHE */
+
+#define ZF_ENABLE_VERIFY 1
+#define ZF_VERIFY_SIZE 512
+
+
+/* Set to 1 to compile words to native x86-64 code. Words which passed the
+ * stack effect verification are compiled after ZF_JIT_THRESHOLD calls, or
+ * explicitly with the 'jit' word. The code is generated into ZF_JIT_SIZE
+ * bytes of executable memory mapped with mmap(). Words the compiler can not
+ * handle keep running in the interpreter. Requires ZF_ENABLE_VERIFY, a float
+ * or double zf_cell and a POSIX host */
+
+#ifdef __x86_64__
+#define ZF_ENABLE_JIT 1
+#else
+#define ZF_ENABLE_JIT 0
+#endif
+#define ZF_JIT_THRESHOLD 64
+#define ZF_JIT_SIZE 65536
+
+
+/* Set to 1 to support words translated to C ahead of time by z4c. This adds
+ * the '(aot)' primitive, which calls the functions in the zf_aot_words[]
+ * table generated with 'z4c -c'; with ZF_ENABLE_VERIFY it also adds the
+ * translator, zf_aot_translate(). The primitive changes the numbering of the
+ * primitives after it, so dictionary images are only compatible between
+ * builds with the same setting */
+
+#define ZF_ENABLE_AOT 0
+
+
+/* Set to 1 to compile the code of words marked with 'inline' into the words
+ * calling them, instead of a call, which saves the return stack traffic and a
+ * dispatch on every call. Only words without branches that leave the return
+ * stack alone can be inlined. A copy does not see later changes to the code
+ * of the word, so do not mark words that are patched after their definition.
+ * Setting ZF_INLINE_SIZE above 0 also inlines unmarked words with up to that
+ * many bytes of code, unless they are marked with 'noinline'; only do that if
+ * no code is patched at all. The marks take ZF_DICT_SIZE / 4 bytes of RAM.
+ * This adds primitives, so dictionary images are only compatible between
+ * builds with the same setting */
+
+#define ZF_ENABLE_INLINE 1
+#define ZF_INLINE_SIZE 0
+
+
+/* Set to 1 to run cooperative tasks inside the interpreter. The host creates
+ * up to ZF_TASKS_MAX - 1 tasks from execution tokens with zf_task_create(),
+ * each with its own stacks, and the 'pause' primitive switches to the next
+ * task. Each task record takes two pointers and five zf_addr of RAM besides
+ * its stacks. This adds a primitive, so dictionary images are only
+ * compatible between builds with the same setting */
+
+#define ZF_ENABLE_TASKS 1
+#define ZF_TASKS_MAX 4
+
+
+/* Set to 1 to add zf_run_steps(), which runs an evaluation for at most a
+ * given number of instructions and can resume it later, for hosts that
+ * time-slice their scripts, and to let syscalls suspend the evaluation with
+ * ZF_INPUT_SUSPEND until zf_resume(). Adds a check of the budget to every
+ * instruction */
+
+#define ZF_ENABLE_YIELD 1
+
+
+/* Storage class for the current interpreter context and the scratch buffers
+ * of the interpreter. Set to the thread local storage class of the compiler
+ * to run different contexts on different threads at the same time, or leave
+ * empty if the interpreter only runs on one thread */
+
+#define ZF_THREAD_LOCAL __thread
+
+
+/* Set to 1 to add zf_eval_batch(), which runs a batch of jobs on a pool of
+ * threads with one context per thread. Requires a POSIX host with threads,
+ * ZF_THREAD_LOCAL set to the thread local storage class of the compiler,
+ * and host callbacks which can be called from several threads at once */
+
+#define ZF_ENABLE_BATCH 1
+
+
+/* Set to 1 to add channels, bounded lock-free queues of cells for passing
+ * messages between contexts, which may run on different threads. Up to
+ * ZF_CHANNELS_MAX channels can be attached to a context with
+ * zf_chan_attach(), for the 'chan-send', 'chan-recv' and 'chan-try-recv'
+ * words. Requires ZF_ENABLE_YIELD and C11 atomics. This adds primitives, so
+ * dictionary images are only compatible between builds with the same
+ * setting */
+
+#define ZF_ENABLE_CHANNELS 1
+#define ZF_CHANNELS_MAX 8
+
+
+/* Set to 1 to add zf_ctx_snapshot() and zf_fork(), which clone the state of
+ * a context into any number of new contexts. The snapshot is kept in a
+ * temporary file which the forks map copy-on-write, so a fork only costs
+ * the pages it modifies. Requires a POSIX host with mmap() */
+
+#define ZF_ENABLE_SNAPSHOT 1
+
+
+/* Set to 1 to add zf_pmap() and zf_preduce(), which map or reduce an array
+ * in the dictionary on a number of threads, each running a fork of the
+ * context. Requires ZF_ENABLE_SNAPSHOT, threads and ZF_THREAD_LOCAL set to
+ * the thread local storage class of the compiler */
+
+#define ZF_ENABLE_PARALLEL 1
+
+
+/* Set to 1 to convert numbers in the interpreter, instead of calling
+ * zf_host_parse_num() for every word which is not in the dictionary. Decimal
+ * integers, hexadecimal with a '0x' or '$' prefix and binary with a '0b'
+ * prefix are understood; a leading zero does not mean octal. With a float or
+ * double zf_cell, decimal fractions with an exponent are converted as well
+ * when the result is exact. Anything else is still passed to the host */
+
+#define ZF_ENABLE_PARSE_NUM 1
+
+
 /* Type to use for the basic cell, data stack and return stack. Choose a signed
  * integer type that suits your needs, or 'float' or 'double' if you need
  * floating point numbers */
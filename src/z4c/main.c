@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -6,15 +7,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "zforth.h"
 
 static void print_result(zf_result r);
 static void usage(void);
-static zf_result do_eval(const char *src, int line, const char *buf);
+static zf_result do_eval(const char *src, int line, const char *buf, size_t len);
 static void include(const char *fname);
 static void save(const char *fname, zf_cell start, zf_cell end);
 static void load(const char *fname);
+static void translate(const char *fname, zf_cell start);
+
+/* Words to translate with -a. If none are given, the translator picks the
+ * words with loops */
+
+static const char *aot_names[64];
+static int aot_name_count;
+static FILE *aot_file;
+
+/* z4c translates words to C, but never runs the translated code */
+
+const zf_aot_word zf_aot_words[] = {NULL};
+const zf_addr zf_aot_count = 0;
 
 int main(int argc, char **argv)
 {
@@ -23,11 +40,12 @@ int main(int argc, char **argv)
     int quiet = 0;
     const char *fname_load = NULL;
     const char *fname_save = NULL;
+    const char *fname_aot = NULL;
 
     // Parse command line options
 
     int c;
-    while ((c = getopt(argc, argv, "ho:l:tq")) != -1)
+    while ((c = getopt(argc, argv, "ho:l:tqc:a:")) != -1)
     {
         switch (c)
         {
@@ -46,6 +64,17 @@ int main(int argc, char **argv)
             case 'q':
                 quiet = 1;
                 break;
+            case 'c':
+                fname_aot = optarg;
+                break;
+            case 'a':
+                if (aot_name_count == sizeof(aot_names) / sizeof(aot_names[0]))
+                {
+                    fprintf(stderr, "too many words to translate\n");
+                    exit(1);
+                }
+                aot_names[aot_name_count++] = optarg;
+                break;
         }
     }
 
@@ -104,6 +133,12 @@ int main(int argc, char **argv)
         printf("Welcome to zForth, %d bytes used\n", (int)here);
     }
 
+    // Translate words to C if requested, this replaces their code in the dict
+    if (fname_aot)
+    {
+        translate(fname_aot, start);
+    }
+
     // Save dict to disk if requested
     if (fname_save)
     {
@@ -117,7 +152,7 @@ int main(int argc, char **argv)
         char buf[4096];
         if (fgets(buf, sizeof(buf), stdin))
         {
-            do_eval("stdin", ++line, buf);
+            do_eval("stdin", ++line, buf, strlen(buf));
             printf("\n");
         }
         else
@@ -138,7 +173,6 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
 
         case ZF_SYSCALL_EMIT:
             putchar((char)zf_pop());
-            fflush(stdout);
             break;
 
         case ZF_SYSCALL_PRINT:
@@ -154,7 +188,6 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
             }
             void *buf = (uint8_t *)zf_dump(NULL) + (int)addr;
             (void)fwrite(buf, 1, len, stdout);
-            fflush(stdout);
         }
         break;
 
@@ -165,6 +198,10 @@ zf_input_state zf_host_sys(zf_syscall_id id, const char *input)
             exit(0);
             break;
 
+        case ZF_SYSCALL_USER + 6:
+            fflush(stdout);
+            break;
+
         default:
             printf("unhandled syscall %d\n", id);
             break;
@@ -194,7 +231,7 @@ zf_cell zf_host_parse_num(const char *buf)
 
 static void print_result(zf_result r)
 {
-    char *msg;
+    const char *msg = NULL;
     switch (r)
     {
         case ZF_OK: msg = "OK"; break;
@@ -210,6 +247,7 @@ static void print_result(zf_result r)
         case ZF_ABORT_DIVISION_BY_ZERO: msg = "DIVISION_BY_ZERO"; break;
         case ZF_ABORT_INVALID_USERVAR: msg = "INVALID_USERVAR"; break;
         case ZF_ABORT_EXTERNAL: msg = "EXTERNAL"; break;
+        case ZF_YIELD: msg = "YIELD"; break;
     }
     puts(msg);
 }
@@ -224,12 +262,14 @@ static void usage(void)
             "   -t         enable tracing\n"
             "   -l FILE    load dictionary from FILE\n"
             "   -o FILE    save dictionary to FILE\n"
+            "   -c FILE    translate words to C in FILE\n"
+            "   -a WORD    translate WORD only, may be repeated\n"
             "   -q         quiet\n");
 }
 
-static zf_result do_eval(const char *src, int line, const char *buf)
+static zf_result do_eval(const char *src, int line, const char *buf, size_t len)
 {
-    zf_result rv = zf_eval(buf);
+    zf_result rv = zf_eval_n(buf, len);
     if (rv != ZF_OK)
     {
         print_result(rv);
@@ -237,37 +277,109 @@ static zf_result do_eval(const char *src, int line, const char *buf)
     return rv;
 }
 
-static void include(const char *fname)
+// Read all of a file which can not be mapped, such as a pipe, into a growing buffer
+static char *read_all(int fd, size_t *len)
 {
-    char buf[256];
+    size_t size = 4096;
+    char *buf = malloc(size), *nbuf;
+    ssize_t n;
 
-    FILE *f = fopen(fname, "rb");
+    *len = 0;
+    while (buf)
+    {
+        if (*len == size)
+        {
+            nbuf = realloc(buf, size * 2);
+            if (!nbuf)
+            {
+                break;
+            }
+            buf = nbuf;
+            size *= 2;
+        }
+        n = read(fd, buf + *len, size - *len);
+        if (n == 0)
+        {
+            return buf;
+        }
+        if (n < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (n > 0)
+        {
+            *len += n;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void include(const char *fname)
+{
+    struct stat st;
+    const char *p = NULL;
+    char *buf = NULL;
+    size_t i, len = 0, pos = 0, line_start = 0;
     int line = 1;
-    char *line_start = buf;
     zf_result rv = ZF_ABORT_INTERNAL_ERROR;
-    if (f)
+
+    // Map the whole file and evaluate it in one piece, so words and strings may span lines.
+    // Files which can not be mapped are read instead
+    int fd = open(fname, O_RDONLY);
+    if (fd >= 0)
     {
-        while (fgets(buf, sizeof(buf), f))
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
         {
-            line_start = buf;
-            rv = do_eval(fname, line++, buf);
-            if (rv != ZF_OK)
+            len = st.st_size;
+            p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
             {
-                break;
+                p = NULL;
             }
         }
-        fclose(f);
+        if (!p)
+        {
+            p = buf = read_all(fd, &len);
+        }
+        close(fd);
+    }
+    if (p)
+    {
+        rv = do_eval(fname, line, p, len);
+        pos = zf_eval_pos();
     }
     else
     {
         fprintf(stderr, "error opening file '%s': %s\n", fname, strerror(errno));
     }
 
+    // Report the line and column of the word which failed
     if (rv != ZF_OK)
     {
-        printf(" %s:%d:%d %s\n", fname, line, (int)(buf - line_start), buf);
+        for (i = 0; p && i < pos; i++)
+        {
+            if (p[i] == '\n')
+            {
+                line++;
+                line_start = i + 1;
+            }
+        }
+        for (i = line_start; p && i < len && p[i] != '\n'; i++)
+        {
+        }
+        printf(" %s:%d:%d %.*s\n", fname, line, (int)(pos - line_start) + 1, (int)(i - line_start),
+               p ? p + line_start : "");
         exit(1);
     }
+    if (buf)
+    {
+        free(buf);
+    }
+    else
+    {
+        munmap((void *)p, len);
+    }
 }
 
 static void save(const char *fname, zf_cell start, zf_cell end)
@@ -311,6 +423,7 @@ static void load(const char *fname)
     {
         code_len = fread(code_base, 1, dict_len - tail, f);
         fclose(f);
+        zf_dict_changed();
     }
     else
     {
@@ -327,3 +440,37 @@ static void load(const char *fname)
     }
 }
 
+static int aot_select(const char *name, size_t len)
+{
+    int i;
+    for (i = 0; i < aot_name_count; i++)
+    {
+        if (strlen(aot_names[i]) == len && memcmp(aot_names[i], name, len) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void aot_out(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(aot_file, fmt, va);
+    va_end(va);
+}
+
+static void translate(const char *fname, zf_cell start)
+{
+    aot_file = fopen(fname, "w");
+    if (aot_file == NULL)
+    {
+        fprintf(stderr, "error opening file '%s': %s\n", fname, strerror(errno));
+        exit(1);
+    }
+    zf_addr count = zf_aot_translate(start, aot_name_count ? aot_select : NULL, aot_out);
+    fclose(aot_file);
+    printf("%s: translated %d words to %s\n", __func__, (int)count, fname);
+}
+
@@ -3,6 +3,29 @@
 
 #include "zforth.h"
 
+#if ZF_ENABLE_JIT || ZF_ENABLE_SNAPSHOT
+#include <sys/mman.h>
+#endif
+
+#if ZF_ENABLE_BATCH || ZF_ENABLE_PARALLEL
+#include <pthread.h>
+#include <stdlib.h>
+#endif
+
+#if ZF_ENABLE_CHANNELS
+#include <stdatomic.h>
+#endif
+
+#if ZF_ENABLE_PARSE_NUM
+#include <float.h>
+#endif
+
+#if ZF_ENABLE_SNAPSHOT
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
 /* Flags and length encoded in words */
 
 #define ZF_FLAG_IMMEDIATE (1 << 6)
@@ -79,6 +102,42 @@ typedef enum
     PRIM_XOR,
     PRIM_SHL,
     PRIM_SHR,
+#if ZF_ENABLE_JIT
+    PRIM_JIT,
+#endif
+#if ZF_ENABLE_AOT
+    PRIM_AOT,
+#endif
+#if ZF_ENABLE_INLINE
+    PRIM_INLINE,
+    PRIM_NOINLINE,
+#endif
+#if ZF_ENABLE_TASKS
+    PRIM_PAUSE,
+#endif
+#if ZF_ENABLE_CHANNELS
+    PRIM_CHAN_SEND,
+    PRIM_CHAN_RECV,
+    PRIM_CHAN_TRY_RECV,
+#endif
+#if ZF_ENABLE_FUSION
+    PRIM_LIT_ADD,
+    PRIM_LIT_SUB,
+    PRIM_LIT_MUL,
+    PRIM_LIT_PICK,
+    PRIM_LIT_PICKR,
+    PRIM_2DUP,
+    PRIM_EQ_JMP0,
+    PRIM_LTZ_JMP0,
+#endif
+    /* Counted loops come last so the baseline prims keep their numbers */
+    PRIM_DO,
+    PRIM_LOOP,
+    PRIM_LOOPP,
+    PRIM_I,
+    PRIM_J,
+    PRIM_LEAVE,
+    PRIM_UNLOOP,
     PRIM_COUNT
 } zf_prim;
 
@@ -118,42 +177,349 @@ static const char prim_names[] =
     _("|")          // ( x y | -> z )       Bitwise OR
     _("^")          // ( x y ^ -> z )       Bitwise XOR
     _("<<")         // ( x y << -> z )      Bitwise shift left
-    _(">>");        // ( x y >> -> z )      Bitwise shift right
+    _(">>")         // ( x y >> -> z )      Bitwise shift right
+#if ZF_ENABLE_JIT
+    _("jit")        // ( xt jit -> f )      Compile word to native code
+#endif
+#if ZF_ENABLE_AOT
+    _("(aot)")      // ( (aot) )            Call word translated to C by z4c
+#endif
+#if ZF_ENABLE_INLINE
+    _("_inline")    // ( inline )           Always inline last defined word
+    _("_noinline")  // ( noinline )         Never inline last defined word
+#endif
+#if ZF_ENABLE_TASKS
+    _("pause")      // ( pause )            Switch to the next task
+#endif
+#if ZF_ENABLE_CHANNELS
+    _("chan-send")  // ( v id chan-send )   Send value to channel, wait while it is full
+    _("chan-recv")  // ( id chan-recv -> v ) Receive value from channel, wait while it is empty
+    _("chan-try-recv") // ( id chan-try-recv -> v 1 | 0 ) Receive value if there is one
+#endif
+#if ZF_ENABLE_FUSION
+    _("(lit+)")     // ( x (lit+) -> z )    Superinstruction for lit +
+    _("(lit-)")     // ( x (lit-) -> z )    Superinstruction for lit -
+    _("(lit*)")     // ( x (lit*) -> z )    Superinstruction for lit *
+    _("(litpick)")  // ( (litpick) -> x )   Superinstruction for lit pick
+    _("(litpickr)") // ( (litpickr) -> x )  Superinstruction for lit pickr
+    _("(2dup)")     // ( x y (2dup) -> x y x y ) Superinstruction for over over
+    _("(=jmp0)")    // ( x y (=jmp0) )      Superinstruction for = jmp0
+    _("(<0jmp0)")   // ( x (<0jmp0) )       Superinstruction for <0 jmp0
+#endif
+    _("(do)")       // ( limit start (do) ) Start counted loop
+    _("(loop)")     // ( (loop) )           Increment index, jump back if below limit
+    _("(loop+)")    // ( n (loop+) )        Add n to index, jump back if below limit
+    _("i")          // ( i -> n )           Push index of innermost loop
+    _("j")          // ( j -> n )           Push index of next outer loop
+    _("leave")      // ( leave )            Exit innermost loop
+    _("unloop")     // ( unloop )           Drop loop parameters from return stack
+    ;
+
+#if ZF_ENABLE_FUSION
+
+/* Superinstructions are created by fuse() from two adjacent instructions, by
+ * replacing the opcode of the first one. The original instructions are left in
+ * place behind it, so the superinstruction has to skip over them: 'pre' bytes
+ * are skipped before reading the inline operand, if it has one, and 'post'
+ * bytes after it. The fused opcodes are the range PRIM_FUSED..PRIM_FUSED_END */
+
+#define PRIM_FUSED PRIM_LIT_ADD
+#define PRIM_FUSED_END PRIM_DO
+
+typedef struct
+{
+    uint8_t pre;     /* Bytes to skip before the operand */
+    uint8_t operand; /* 1 if there is an inline operand */
+    uint8_t post;    /* Bytes to skip after the operand */
+} zf_fused_layout;
+
+static const zf_fused_layout fused_layout[PRIM_FUSED_END - PRIM_FUSED] = {
+    [PRIM_LIT_ADD - PRIM_FUSED] = {0, 1, 1},   /* lit <n> + */
+    [PRIM_LIT_SUB - PRIM_FUSED] = {0, 1, 1},   /* lit <n> - */
+    [PRIM_LIT_MUL - PRIM_FUSED] = {0, 1, 1},   /* lit <n> * */
+    [PRIM_LIT_PICK - PRIM_FUSED] = {0, 1, 1},  /* lit <n> pick */
+    [PRIM_LIT_PICKR - PRIM_FUSED] = {0, 1, 1}, /* lit <n> pickr */
+    [PRIM_2DUP - PRIM_FUSED] = {5, 0, 0},      /* (litpick) 1 pick (litpick) 1 pick */
+    [PRIM_EQ_JMP0 - PRIM_FUSED] = {1, 1, 0},   /* = jmp0 <addr> */
+    [PRIM_LTZ_JMP0 - PRIM_FUSED] = {1, 1, 0},  /* <0 jmp0 <addr> */
+};
+
+#endif
+
+#if ZF_ENABLE_DECODE_CACHE
+
+/* Decoded instruction cache. Cells in the dictionary are stored with a
+ * variable length encoding which the inner interpreter would otherwise have to
+ * decode every time an instruction is executed. The cache holds fixed size
+ * records with the decoded opcode, the inline operand of primitives which
+ * have one, and the address of the next instruction. The cache is direct
+ * mapped on the instruction address, and records are dropped when any of the
+ * bytes they were decoded from are written by dict_put_bytes() */
+
+typedef struct
+{
+    zf_addr addr;    /* Address of the instruction, 0 if the record is unused */
+    zf_addr code;    /* Primitive or address of the word to call */
+    zf_addr next;    /* Address of the next instruction */
+    zf_cell operand; /* Inline operand of primitives which have one */
+} zf_decoded;
+
+/* Maximum number of dictionary bytes covered by one record: a one byte
+ * primitive followed by a full size operand, plus the bytes a superinstruction
+ * skips over */
+
+#define ZF_DECODE_SPAN (6 + sizeof(zf_cell))
+
+static void decode_invalidate(zf_addr addr, size_t len);
+
+#endif
+
+#if ZF_ENABLE_VERIFY
+#if !ZF_ENABLE_TOS_CACHE
+#error "ZF_ENABLE_VERIFY requires ZF_ENABLE_TOS_CACHE"
+#endif
+
+/* Result of the stack effect verification of a word, see verify() */
+
+typedef struct
+{
+    zf_addr xt;   /* Execution token, 0 if the record is unused */
+    uint8_t need; /* Data stack cells taken from the caller */
+    uint8_t max;  /* Maximum growth of the data stack */
+    uint8_t rmax; /* Maximum growth of the return stack */
+    int8_t net;   /* Effect on the data stack depth */
+#if ZF_ENABLE_JIT
+    uint16_t calls; /* Calls counted towards ZF_JIT_THRESHOLD */
+    uint32_t jit;   /* Offset of the native code in the JIT arena plus one, 0 if none */
+#endif
+} zf_verified;
+
+static void verify_invalidate(zf_addr addr, size_t len);
+static void run_verified(zf_addr rbase);
+#endif
+
+#if ZF_ENABLE_JIT
+#if !ZF_ENABLE_VERIFY
+#error "ZF_ENABLE_JIT requires ZF_ENABLE_VERIFY"
+#endif
+static void jit_reset(void);
+#endif
+
+#if ZF_ENABLE_PARALLEL && !ZF_ENABLE_SNAPSHOT
+#error "ZF_ENABLE_PARALLEL requires ZF_ENABLE_SNAPSHOT"
+#endif
+
+#if ZF_ENABLE_CHANNELS
+
+#if !ZF_ENABLE_YIELD
+#error "ZF_ENABLE_CHANNELS requires ZF_ENABLE_YIELD"
+#endif
+
+/* Channels. A channel is a bounded lock-free queue of cells shared by any
+ * number of contexts on any number of threads, after the bounded MPMC queue
+ * by Dmitry Vyukov. Every slot has a sequence number which tells senders and
+ * receivers whose turn it is: a sender claims the slot at 'head' when its
+ * sequence number equals the position, a receiver claims the slot at 'tail'
+ * when it is one more. Claiming a slot is a single compare-and-swap on the
+ * position, and filling or emptying it publishes the slot to the other side
+ * by storing the next sequence number. With a single sender and a single
+ * receiver the compare-and-swap never fails. The two positions sit on cache
+ * lines of their own, so senders and receivers do not slow each other down */
+
+#define ZF_CHAN_LINE 64
+
+typedef struct
+{
+    atomic_size_t seq; /* Position the slot is ready for */
+    zf_cell value;
+} zf_chan_slot;
+
+struct zf_chan
+{
+    atomic_size_t head; /* Position of the next value sent */
+    char pad_head[ZF_CHAN_LINE - sizeof(atomic_size_t)];
+    atomic_size_t tail; /* Position of the next value received */
+    char pad_tail[ZF_CHAN_LINE - sizeof(atomic_size_t)];
+    size_t mask;        /* Number of slots - 1 */
+    zf_chan_slot slot[];
+};
+
+#endif
+
+#if ZF_ENABLE_TASKS
+
+/* Cooperative tasks. Every task has its own stacks and instruction pointer,
+ * and shares the dictionary with the other tasks of its context. Task 0 runs
+ * the words evaluated by zf_eval(); the host creates the others from an
+ * execution token with zf_task_create(). 'pause' saves the state of the
+ * running task in its record and switches the context to the stacks of the
+ * next task in round robin order. A task is removed when its word returns or
+ * when it aborts */
+
+typedef struct
+{
+    zf_cell *dstack;     /* Data stack, NULL if the record is unused */
+    zf_addr dstack_size; /* Data stack size in cells */
+    zf_cell *rstack;     /* Return stack */
+    zf_addr rstack_size; /* Return stack size in cells */
+    zf_addr dsp;         /* Saved data stack pointer */
+    zf_addr rsp;         /* Saved return stack pointer */
+    zf_addr ip;          /* Saved instruction pointer */
+} zf_task;
+
+#endif
 
-/* Stacks and dictionary memory */
+/* Size of the dictionary address space, which the tables kept per dictionary
+ * byte cover. A ROM image takes up to ZF_ROM_SIZE bytes of it besides the
+ * ZF_DICT_SIZE bytes of RAM */
 
-static zf_cell rstack[ZF_RSTACK_SIZE];
-static zf_cell dstack[ZF_DSTACK_SIZE];
-static uint8_t dict[ZF_DICT_SIZE];
+#if ZF_ENABLE_ROM
+#define ZF_ADDR_SPACE (ZF_ROM_SIZE + ZF_DICT_SIZE)
+#else
+#define ZF_ADDR_SPACE ZF_DICT_SIZE
+#endif
+
+/* Interpreter context. All state of an interpreter instance lives here, so a
+ * process can run any number of isolated interpreters. The dictionary and the
+ * stacks are provided by the caller of zf_ctx_init(); the tables kept per
+ * dictionary byte are sized for ZF_ADDR_SPACE, which limits the dictionary
+ * size of a context. The API functions work on the context pointed to by
+ * 'ctx', which the zf_ctx_*() functions switch to for the duration of the
+ * call, so host callbacks can keep using zf_push() and friends */
+
+struct zf_ctx
+{
+    uint8_t *dict;        /* Dictionary memory */
+    zf_addr dict_size;    /* Dictionary size in bytes */
+#if ZF_ENABLE_ROM
+    const uint8_t *rom;   /* Dictionary image executed in place */
+    zf_addr rom_size;     /* Size of the image, or of the user variables */
+#endif
+    zf_cell *dstack;      /* Data stack */
+    zf_addr dstack_size;  /* Data stack size in cells */
+    zf_cell *rstack;      /* Return stack */
+    zf_addr rstack_size;  /* Return stack size in cells */
+    zf_addr *uservar;     /* User variables, at the start of the dictionary */
+#if ZF_ENABLE_TOS_CACHE
+    /* One spare slot below the data stack allows run() to spill the cached
+     * top of stack without checking for an empty stack first. The element at
+     * depth n is stored in dstack_mem[n + 1], so run() finds the slot of the
+     * cached top of stack at dstack_mem[dsp] */
+    zf_cell *dstack_mem;
+#endif
+
+    zf_input_state input_state; /* Input requested by a suspended primitive */
+    zf_addr ip;                 /* Instruction pointer */
+    jmp_buf *jmpbuf;            /* setjmp env of the innermost zf_ctx_eval() */
+    const char *src;            /* Rest of the input of eval(), NULL at the end */
+    size_t src_len;             /* Length of the rest of the input */
+    const char *src_base;       /* Start of the input of the evaluation */
+    size_t src_pos;             /* Offset of the word being evaluated */
+    size_t eval_pos;            /* 'src_pos' where the last evaluation stopped */
+    char token[32];             /* Word passed on by handle_word() */
+
+#if ZF_ENABLE_DECODE_CACHE
+    zf_decoded decode_cache[ZF_DECODE_CACHE_SIZE];
+#endif
+
+#if ZF_ENABLE_WORD_HASH
+    /* Hash index for find_word(). An open addressed table maps the hash of a
+     * name to the header of the most recent word with that name, so redefined
+     * words keep shadowing the older ones. Entries are never removed; when the
+     * table is too full to take a new name it is marked as overflowed and
+     * find_word() falls back to walking the dictionary for names it can not
+     * find in the table. The index is rebuilt from the dictionary when LATEST
+     * was changed by anything but create() and by zf_dict_changed() */
+    zf_addr word_hash[ZF_WORD_HASH_SIZE];
+    zf_addr word_hash_count;
+    zf_addr word_hash_latest;
+    int word_hash_overflow;
+#endif
+
+#if ZF_ENABLE_INLINE
+    /* Words marked with 'inline' and 'noinline', by address of the word,
+     * since the word header has no room for more flags */
+    uint8_t inline_always[ZF_ADDR_SPACE / 8];
+    uint8_t inline_never[ZF_ADDR_SPACE / 8];
+    /* HERE after compiling "'", which takes the word compiled next as its
+     * operand and needs a call to it */
+    zf_addr inline_tick;
+#endif
+
+#if ZF_ENABLE_VERIFY
+    zf_verified verified[ZF_VERIFY_SIZE];
+    /* Dictionary bytes holding code of verified words. Writing to any of
+     * them drops all verification results, and makes run_verified() return */
+    uint8_t verified_code[ZF_ADDR_SPACE / 8];
+    int verify_dropped;
+#endif
+
+#if ZF_ENABLE_TASKS
+    zf_task tasks[ZF_TASKS_MAX];
+    zf_addr task;        /* Running task */
+    zf_addr task_parked; /* Task that returned to the host, 0 if none */
+#endif
+
+#if ZF_ENABLE_YIELD
+    /* Instruction budget of zf_ctx_run_steps(). 'steps' is one more than the
+     * number of instructions left, or 0 without a budget. When it runs out,
+     * run() returns with all state intact and the rest of the input is kept
+     * in 'src' until the evaluation is resumed */
+    uint32_t steps;
+    int yielded;
+#endif
+
+#if ZF_ENABLE_CHANNELS
+    zf_chan *chans[ZF_CHANNELS_MAX]; /* Channels by id, NULL if not attached */
+    zf_addr chan_waits;              /* Task switches since a channel moved */
+#endif
+
+#if ZF_ENABLE_SNAPSHOT
+    size_t fork_size; /* Size of the mapping of a fork, 0 if not a fork */
+#endif
+
+#if ZF_ENABLE_JIT
+    uint8_t *jit_arena;     /* Executable memory, mapped on first use */
+    size_t jit_here;        /* Offset of the next free byte */
+    size_t jit_start;       /* Offset of the first compiled word */
+    size_t jit_exit_common; /* Offset of the code shared by all exits */
+#endif
+};
 
-/* State and stack and interpreter pointers */
+/* Storage class for the current context and the scratch buffers used while
+ * a word is traced, verified, fused or compiled. zfconf.h can set this to the
+ * thread local storage class of the compiler, so different threads can run
+ * different contexts at the same time */
 
-static zf_input_state input_state;
-static zf_addr ip;
+#ifndef ZF_THREAD_LOCAL
+#define ZF_THREAD_LOCAL
+#endif
 
-/* setjmp env for handling aborts */
+/* The default context used by zf_init(), and the current context */
 
-static jmp_buf jmpbuf;
+static uint8_t default_dict[ZF_DICT_SIZE];
+static zf_cell default_dstack[ZF_DSTACK_SIZE + ZF_ENABLE_TOS_CACHE];
+static zf_cell default_rstack[ZF_RSTACK_SIZE];
+static zf_ctx default_ctx;
+static ZF_THREAD_LOCAL zf_ctx *ctx = &default_ctx;
 
 /* User variables are variables which are shared between forth and C. From
  * forth these can be accessed with @ and ! at pseudo-indices in low memory, in
  * C they are stored in an array of zf_addr with friendly reference names
  * through some macros */
 
-#define HERE      uservar[ZF_USERVAR_HERE]      /* compilation pointer in dictionary */
-#define LATEST    uservar[ZF_USERVAR_LATEST]    /* pointer to last compiled word */
-#define TRACE     uservar[ZF_USERVAR_TRACE]     /* trace enable flag */
-#define COMPILING uservar[ZF_USERVAR_COMPILING] /* compiling flag */
-#define POSTPONE  uservar[ZF_USERVAR_POSTPONE]  /* flag to indicate next imm word should be compiled */
-#define DSP       uservar[ZF_USERVAR_DSP]       /* data stack pointer */
-#define RSP       uservar[ZF_USERVAR_RSP]       /* return stack pointer */
+#define HERE      ctx->uservar[ZF_USERVAR_HERE]      /* compilation pointer in dictionary */
+#define LATEST    ctx->uservar[ZF_USERVAR_LATEST]    /* pointer to last compiled word */
+#define TRACE     ctx->uservar[ZF_USERVAR_TRACE]     /* trace enable flag */
+#define COMPILING ctx->uservar[ZF_USERVAR_COMPILING] /* compiling flag */
+#define POSTPONE  ctx->uservar[ZF_USERVAR_POSTPONE]  /* flag to indicate next imm word should be compiled */
+#define DSP       ctx->uservar[ZF_USERVAR_DSP]       /* data stack pointer */
+#define RSP       ctx->uservar[ZF_USERVAR_RSP]       /* return stack pointer */
 
 static const char uservar_names[] = _("h") _("latest") _("trace") _("compiling") _("_postpone") _("dsp") _("rsp");
-static zf_addr *uservar = (zf_addr *)dict;
 
 /* Prototypes */
 
-static void do_prim(zf_prim prim, const char *input);
 static zf_addr dict_get_cell(zf_addr addr, zf_cell *v);
 static void dict_get_bytes(zf_addr addr, void *buf, size_t len);
 
@@ -181,7 +547,7 @@ static void do_trace(const char *fmt, ...)
 static const char *op_name(zf_addr addr)
 {
     zf_addr w = LATEST;
-    static char name[32];
+    static ZF_THREAD_LOCAL char name[32];
 
     while (TRACE && w)
     {
@@ -225,7 +591,7 @@ static int isspace(int c)
  */
 void zf_abort(zf_result reason)
 {
-    longjmp(jmpbuf, reason);
+    longjmp(*ctx->jmpbuf, reason);
 }
 
 /**
@@ -235,9 +601,9 @@ void zf_abort(zf_result reason)
  */
 void zf_push(zf_cell v)
 {
-    CHECK(DSP < ZF_DSTACK_SIZE, ZF_ABORT_DSTACK_OVERRUN);
+    CHECK(DSP < ctx->dstack_size, ZF_ABORT_DSTACK_OVERRUN);
     trace("»" ZF_CELL_FMT " ", v);
-    dstack[DSP++] = v;
+    ctx->dstack[DSP++] = v;
 }
 
 /**
@@ -249,7 +615,7 @@ zf_cell zf_pop(void)
 {
     zf_cell v;
     CHECK(DSP > 0, ZF_ABORT_DSTACK_UNDERRUN);
-    v = dstack[--DSP];
+    v = ctx->dstack[--DSP];
     trace("«" ZF_CELL_FMT " ", v);
     return v;
 }
@@ -262,7 +628,7 @@ zf_cell zf_pop(void)
 zf_cell zf_pick(zf_addr n)
 {
     CHECK(n < DSP, ZF_ABORT_DSTACK_UNDERRUN);
-    return dstack[DSP - n - 1];
+    return ctx->dstack[DSP - n - 1];
 }
 
 /**
@@ -272,11 +638,13 @@ zf_cell zf_pick(zf_addr n)
  */
 static void zf_pushr(zf_cell v)
 {
-    CHECK(RSP < ZF_RSTACK_SIZE, ZF_ABORT_RSTACK_OVERRUN);
+    CHECK(RSP < ctx->rstack_size, ZF_ABORT_RSTACK_OVERRUN);
     trace("r»" ZF_CELL_FMT " ", v);
-    rstack[RSP++] = v;
+    ctx->rstack[RSP++] = v;
 }
 
+#if !ZF_ENABLE_TOS_CACHE
+
 /**
  * @brief  Pop a value from the return stack
  * @param  None
@@ -286,11 +654,13 @@ static zf_cell zf_popr(void)
 {
     zf_cell v;
     CHECK(RSP > 0, ZF_ABORT_RSTACK_UNDERRUN);
-    v = rstack[--RSP];
+    v = ctx->rstack[--RSP];
     trace("r«" ZF_CELL_FMT " ", v);
     return v;
 }
 
+#endif
+
 /**
  * @brief  Pick a value from the return stack
  * @param  n: Index of the value to pick (0 = top of stack)
@@ -299,9 +669,43 @@ static zf_cell zf_popr(void)
 zf_cell zf_pickr(zf_addr n)
 {
     CHECK(n < RSP, ZF_ABORT_RSTACK_UNDERRUN);
-    return rstack[RSP - n - 1];
+    return ctx->rstack[RSP - n - 1];
+}
+
+/* Dictionary memory. With ZF_ENABLE_ROM the dictionary can start with an
+ * image in read-only memory, which is executed in place: the addresses below
+ * the size of the image are read from the image, except for the user
+ * variables, and the RAM holds the user variables followed by the words
+ * defined after the image. DICT_MEM() gets a pointer to the byte at an
+ * address for reading, DICT_RAM() for writing */
+
+#if ZF_ENABLE_ROM
+
+static uint8_t *dict_ram(zf_addr addr)
+{
+    if (addr >= ctx->rom_size)
+    {
+        addr -= ctx->rom_size - ZF_USERVAR_COUNT * sizeof(zf_addr);
+    }
+    return &ctx->dict[addr];
+}
+
+static const uint8_t *dict_mem(zf_addr addr)
+{
+    if (addr >= ZF_USERVAR_COUNT * sizeof(zf_addr) && addr < ctx->rom_size)
+    {
+        return &ctx->rom[addr];
+    }
+    return dict_ram(addr);
 }
 
+#define DICT_MEM(addr) dict_mem(addr)
+#define DICT_RAM(addr) dict_ram(addr)
+#else
+#define DICT_MEM(addr) (&ctx->dict[addr])
+#define DICT_RAM(addr) (&ctx->dict[addr])
+#endif
+
 /**
  * @brief     Put bytes in dictionary
  * @param     addr: Address in dictionary
@@ -313,10 +717,21 @@ zf_cell zf_pickr(zf_addr n)
 static zf_addr dict_put_bytes(zf_addr addr, const void *buf, size_t len)
 {
     const uint8_t *p = (const uint8_t *)buf;
+    uint8_t *d;
     size_t i = len;
-    CHECK(addr < ZF_DICT_SIZE - len, ZF_ABORT_OUTSIDE_MEM);
+    CHECK(addr < ctx->dict_size - len, ZF_ABORT_OUTSIDE_MEM);
+#if ZF_ENABLE_ROM
+    CHECK(addr + len <= ZF_USERVAR_COUNT * sizeof(zf_addr) || addr >= ctx->rom_size, ZF_ABORT_OUTSIDE_MEM);
+#endif
+#if ZF_ENABLE_DECODE_CACHE
+    decode_invalidate(addr, len);
+#endif
+#if ZF_ENABLE_VERIFY
+    verify_invalidate(addr, len);
+#endif
+    d = DICT_RAM(addr);
     while (i--)
-        dict[addr++] = *p++;
+        *d++ = *p++;
     return len;
 }
 
@@ -330,9 +745,9 @@ static zf_addr dict_put_bytes(zf_addr addr, const void *buf, size_t len)
 static void dict_get_bytes(zf_addr addr, void *buf, size_t len)
 {
     uint8_t *p = (uint8_t *)buf;
-    CHECK(addr < ZF_DICT_SIZE - len, ZF_ABORT_OUTSIDE_MEM);
+    CHECK(addr < ctx->dict_size - len, ZF_ABORT_OUTSIDE_MEM);
     while (len--)
-        *p++ = dict[addr++];
+        *p++ = *DICT_MEM(addr++);
 }
 
 /*
@@ -481,6 +896,70 @@ static zf_addr dict_get_cell(zf_addr addr, zf_cell *v)
     return dict_get_cell_typed(addr, v, ZF_MEM_SIZE_VAR);
 }
 
+#if ZF_ENABLE_DECODE_CACHE
+
+/**
+ * @brief  Decode the instruction at the given address into a cache record
+ * @param  dc: Record to fill
+ * @param  addr: Address of the instruction
+ * @return None
+ */
+static void decode(zf_decoded *dc, zf_addr addr)
+{
+    zf_cell v;
+    zf_addr next = addr + dict_get_cell(addr, &v);
+    zf_addr code = v;
+
+    dc->operand = 0;
+    if (code == PRIM_LIT || code == PRIM_JMP || code == PRIM_JMP0 || code == PRIM_LITS ||
+        code == PRIM_DO || code == PRIM_LOOP || code == PRIM_LOOPP
+#if ZF_ENABLE_AOT
+        || code == PRIM_AOT
+#endif
+    )
+    {
+        next += dict_get_cell(next, &dc->operand);
+    }
+#if ZF_ENABLE_FUSION
+    if (code >= PRIM_FUSED && code < PRIM_FUSED_END)
+    {
+        const zf_fused_layout *l = &fused_layout[code - PRIM_FUSED];
+        next += l->pre;
+        if (l->operand)
+        {
+            next += dict_get_cell(next, &dc->operand);
+        }
+        next += l->post;
+    }
+#endif
+    dc->code = code;
+    dc->next = next;
+    dc->addr = addr;
+}
+
+/**
+ * @brief  Drop all cache records decoded from the given range of the dictionary
+ * @param  addr: Start of the range
+ * @param  len: Size of the range in bytes
+ * @return None
+ */
+static void decode_invalidate(zf_addr addr, size_t len)
+{
+    zf_addr a = addr > ZF_DECODE_SPAN ? addr - ZF_DECODE_SPAN + 1 : 0;
+    zf_addr end = addr + len;
+
+    for (; a < end; a++)
+    {
+        zf_decoded *dc = &ctx->decode_cache[a & (ZF_DECODE_CACHE_SIZE - 1)];
+        if (dc->addr == a)
+        {
+            dc->addr = 0;
+        }
+    }
+}
+
+#endif
+
 /**
  * @brief  Add a generic cell to the dictionary, incrementing the HERE pointer
  * @param  v: Value to add
@@ -538,6 +1017,121 @@ static void dict_add_str(const char *s)
     HERE += dict_put_bytes(HERE, s, l);
 }
 
+#if ZF_ENABLE_WORD_HASH
+
+/**
+ * @brief     Check if a word has the given name
+ * @param     w: Address of the word
+ * @param[in] name: Name to compare with
+ * @param     namelen: Length of the name
+ * @param[out] code: Address of the code of the word if the name matches
+ * @return    1 if the name matches, 0 otherwise
+ */
+static int word_has_name(zf_addr w, const char *name, size_t namelen, zf_addr *code)
+{
+    zf_cell link, d;
+    zf_addr p = w;
+    p += dict_get_cell(p, &d);
+    p += dict_get_cell(p, &link);
+    if (ZF_FLAG_LEN((int)d) == namelen && memcmp(name, DICT_MEM(p), namelen) == 0)
+    {
+        *code = p + namelen;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief     Hash a word name (FNV-1a)
+ * @param[in] name: Name of the word
+ * @param     namelen: Length of the name
+ * @return    Index of the first slot to probe in the hash table
+ */
+static zf_addr word_hash_slot(const char *name, size_t namelen)
+{
+    uint32_t h = 2166136261u;
+    while (namelen--)
+    {
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    }
+    return h & (ZF_WORD_HASH_SIZE - 1);
+}
+
+/**
+ * @brief     Add a word to the hash index
+ * @param     w: Address of the word
+ * @param[in] name: Name of the word
+ * @param     namelen: Length of the name
+ * @param     replace: Replace an indexed word with the same name if set to 1
+ * @return    None
+ */
+static void word_hash_add(zf_addr w, const char *name, size_t namelen, int replace)
+{
+    zf_addr i = word_hash_slot(name, namelen);
+    zf_addr code;
+
+    while (ctx->word_hash[i])
+    {
+        if (word_has_name(ctx->word_hash[i], name, namelen, &code))
+        {
+            if (replace)
+            {
+                ctx->word_hash[i] = w;
+            }
+            return;
+        }
+        i = (i + 1) & (ZF_WORD_HASH_SIZE - 1);
+    }
+
+    /* Keep a quarter of the slots free to limit probe lengths. This also
+     * guarantees that every probe sequence ends at an empty slot */
+
+    if (ctx->word_hash_count < ZF_WORD_HASH_SIZE * 3 / 4)
+    {
+        ctx->word_hash[i] = w;
+        ctx->word_hash_count++;
+    }
+    else
+    {
+        ctx->word_hash_overflow = 1;
+    }
+}
+
+/**
+ * @brief  Rebuild the hash index if LATEST was changed behind its back
+ * @param  None
+ * @return None
+ */
+static void word_hash_sync(void)
+{
+    zf_addr w = LATEST;
+
+    if (w == ctx->word_hash_latest)
+    {
+        return;
+    }
+
+    memset(ctx->word_hash, 0, sizeof(ctx->word_hash));
+    ctx->word_hash_count = 0;
+    ctx->word_hash_overflow = 0;
+    ctx->word_hash_latest = w;
+
+    /* The dictionary is walked from the newest word to the oldest, so a name
+     * already in the index belongs to a word shadowing this one */
+
+    while (w)
+    {
+        zf_cell link, d;
+        zf_addr p = w;
+        p += dict_get_cell(p, &d);
+        p += dict_get_cell(p, &link);
+        word_hash_add(w, (const char *)DICT_MEM(p), ZF_FLAG_LEN((int)d), 0);
+        w = link;
+    }
+}
+
+#endif
+
 /**
  * @brief     Create new word, adjusting HERE and LATEST accordingly
  * @param[in] name: Name of the word
@@ -552,23 +1146,51 @@ static void create(const char *name, int flags)
     dict_add_cell((strlen(name)) | flags);
     dict_add_cell(LATEST);
     dict_add_str(name);
+#if ZF_ENABLE_WORD_HASH
+    word_hash_sync();
+    word_hash_add(here_prev, name, strlen(name), 1);
+    ctx->word_hash_latest = here_prev;
+#endif
     LATEST = here_prev;
+#if ZF_ENABLE_INLINE
+    ctx->inline_always[here_prev / 8] &= ~(1 << (here_prev % 8));
+    ctx->inline_never[here_prev / 8] &= ~(1 << (here_prev % 8));
+#endif
     trace("\n===");
 }
 
 /**
  * @brief  Find word in dictionary, returning address and execution token
  * @param[in]  name: Name of the word
+ * @param      namelen: Length of the name
  * @param[out] word: Address of the word
  * @param[out] code: Address of the code
  * @return     1 if the word was found, 0 otherwise
  * @note       TODO: use bool
- * @note       TODO: pass name size
  */
-static int find_word(const char *name, zf_addr *word, zf_addr *code)
+static int find_word(const char *name, size_t namelen, zf_addr *word, zf_addr *code)
 {
     zf_addr w = LATEST;
-    size_t namelen = strlen(name);
+
+#if ZF_ENABLE_WORD_HASH
+    zf_addr i;
+
+    word_hash_sync();
+    i = word_hash_slot(name, namelen);
+    while (ctx->word_hash[i])
+    {
+        if (word_has_name(ctx->word_hash[i], name, namelen, code))
+        {
+            *word = ctx->word_hash[i];
+            return 1;
+        }
+        i = (i + 1) & (ZF_WORD_HASH_SIZE - 1);
+    }
+    if (!ctx->word_hash_overflow)
+    {
+        return 0;
+    }
+#endif
 
     while (w)
     {
@@ -580,7 +1202,7 @@ static int find_word(const char *name, zf_addr *word, zf_addr *code)
         len = ZF_FLAG_LEN((int)d);
         if (len == namelen)
         {
-            const char *name2 = (const char *)&dict[p];
+            const char *name2 = (const char *)DICT_MEM(p);
             if (memcmp(name, name2, len) == 0)
             {
                 *word = w;
@@ -606,389 +1228,1391 @@ static void make_immediate(void)
     dict_put_cell(LATEST, (int)lenflags | ZF_FLAG_IMMEDIATE);
 }
 
+#if ZF_ENABLE_INLINE
+
 /**
- * @brief     Run the inner interpreter
- * @param[in] input: Input null-terminated string
+ * @brief  Mark the last defined word to be inlined always or never
+ * @param  always: 1 to always inline the word, 0 to never inline it
  * @return None
  */
-static void run(const char *input)
+static void mark_inline(int always)
 {
-    while (ip != 0)
-    {
-        zf_cell d;
-        zf_addr i, ip_org = ip;
-        zf_addr l = dict_get_cell(ip, &d);
-        zf_addr code = d;
+    uint8_t bit = 1 << (LATEST % 8);
+    ctx->inline_always[LATEST / 8] = always ? ctx->inline_always[LATEST / 8] | bit : ctx->inline_always[LATEST / 8] & ~bit;
+    ctx->inline_never[LATEST / 8] = always ? ctx->inline_never[LATEST / 8] & ~bit : ctx->inline_never[LATEST / 8] | bit;
+}
 
-        trace("\n " ZF_ADDR_FMT " " ZF_ADDR_FMT " ", ip, code);
-        for (i = 0; i < RSP; i++)
-            trace("┊  ");
+#endif
 
-        ip += l;
+#if ZF_ENABLE_FUSION || ZF_ENABLE_VERIFY
 
-        if (code <= PRIM_COUNT)
-        {
-            do_prim((zf_prim)code, input);
+/**
+ * @brief  Get the execution token of a word
+ * @param  w: Address of the word
+ * @return Address of the code of the word
+ */
+static zf_addr word_xt(zf_addr w)
+{
+    zf_cell d, link;
+    w += dict_get_cell(w, &d);
+    w += dict_get_cell(w, &link);
+    return w + ZF_FLAG_LEN((int)d);
+}
+
+#endif
+
+#if ZF_ENABLE_FUSION || ZF_ENABLE_VERIFY || ZF_ENABLE_INLINE
+
+/* Maximum number of pending branch targets while scanning the code of a word */
+
+#define ZF_SCAN_PENDING 16
+
+/**
+ * @brief      Decode an instruction for the code scanners
+ * @param      addr: Address of the instruction
+ * @param[out] op: Primitive or address of the called word
+ * @param[out] operand: Inline operand, -1 if there is none
+ * @return     Size of the instruction including inline operands and data
+ */
+static zf_addr scan_decode(zf_addr addr, zf_addr *op, zf_cell *operand)
+{
+    zf_cell v;
+    zf_addr len = dict_get_cell(addr, &v);
 
-            /* If the prim requests input, restore IP so that the
-             * next time around we call the same prim again */
+    *op = v;
+    *operand = -1;
 
-            if (input_state != ZF_INPUT_INTERPRET)
+    switch (*op)
+    {
+    case PRIM_LIT:
+    case PRIM_JMP:
+    case PRIM_JMP0:
+    case PRIM_TICK:
+    case PRIM_DO:
+    case PRIM_LOOP:
+    case PRIM_LOOPP:
+#if ZF_ENABLE_AOT
+    case PRIM_AOT:
+#endif
+        len += dict_get_cell(addr + len, operand);
+        break;
+    case PRIM_LITS:
+        len += dict_get_cell(addr + len, operand);
+        len += *operand;
+        break;
+    default:
+#if ZF_ENABLE_FUSION
+        if (*op >= PRIM_FUSED && *op < PRIM_FUSED_END)
+        {
+            const zf_fused_layout *l = &fused_layout[*op - PRIM_FUSED];
+            len += l->pre;
+            if (l->operand)
             {
-                ip = ip_org;
-                break;
+                len += dict_get_cell(addr + len, operand);
             }
+            len += l->post;
         }
-        else
-        {
-            trace("%s/" ZF_ADDR_FMT " ", op_name(code), code);
-            zf_pushr(ip);
-            ip = code;
-        }
-
-        input = NULL;
+#endif
+        break;
     }
+
+    return len;
 }
 
+#endif
+
+#if ZF_ENABLE_INLINE
+
 /**
- * @brief  Execute bytecode from given address
- * @param  addr: Address to execute
- * @return None
+ * @brief  Compile the code of a word into the word being defined instead of
+ *         a call to it. Only words without branches are inlined, which leave
+ *         the return stack as they found it and do not look at their return
+ *         address, so their code runs the same anywhere. Code after the first
+ *         'exit' can not be reached in such a word and is left out. The copy
+ *         does not follow later changes to the word, so unmarked words are
+ *         only inlined when ZF_INLINE_SIZE is set
+ * @param  w: Address of the word
+ * @param  xt: Execution token of the word
+ * @return 1 if the word was inlined, 0 if a call has to be compiled
  */
-static void execute(zf_addr addr)
+static int inline_word(zf_addr w, zf_addr xt)
 {
-    ip = addr;
-    RSP = 0;
-    zf_pushr(0);
+    zf_addr a = xt, op, len;
+    zf_cell operand;
+    int r = 0;
+    int always = ctx->inline_always[w / 8] & (1 << (w % 8));
 
-    trace("\n[%s/" ZF_ADDR_FMT "] ", op_name(ip), ip);
-    run(NULL);
+    /* The word being defined is not complete yet, and "'" needs a call to
+     * take the address from */
+
+    dict_get_cell(w, &operand);
+    if (w == LATEST || HERE == ctx->inline_tick || ((int)operand & ZF_FLAG_IMMEDIATE) ||
+        (ctx->inline_never[w / 8] & (1 << (w % 8))) || (!always && ZF_INLINE_SIZE == 0))
+    {
+        return 0;
+    }
+
+    for (;;)
+    {
+        if (a >= HERE)
+        {
+            return 0;
+        }
+        len = scan_decode(a, &op, &operand);
+        if (op == PRIM_EXIT)
+        {
+            break;
+        }
+        switch (op)
+        {
+        case PRIM_PUSHR:
+            r++;
+            break;
+        case PRIM_POPR:
+            if (r-- == 0)
+            {
+                return 0;
+            }
+            break;
+        case PRIM_JMP:
+        case PRIM_JMP0:
+        case PRIM_PICKR:
+        case PRIM_DO:
+        case PRIM_LOOP:
+        case PRIM_LOOPP:
+        case PRIM_I:
+        case PRIM_J:
+        case PRIM_LEAVE:
+        case PRIM_UNLOOP:
+#if ZF_ENABLE_FUSION
+        case PRIM_LIT_PICKR:
+        case PRIM_EQ_JMP0:
+        case PRIM_LTZ_JMP0:
+#endif
+            return 0;
+        default:
+            break;
+        }
+        a += len;
+    }
+
+    len = a - xt;
+    if (r != 0 || (len > ZF_INLINE_SIZE && !always))
+    {
+        return 0;
+    }
+
+    trace("\n inline " ZF_ADDR_FMT " %d bytes", xt, (int)len);
+    HERE += dict_put_bytes(HERE, DICT_MEM(xt), len);
+    return 1;
 }
 
-static zf_addr peek(zf_addr addr, zf_cell *val, int len)
+#endif
+
+#if ZF_ENABLE_FUSION
+
+/* Superinstruction fusion. When ';' closes a definition its code is scanned
+ * for the instruction pairs listed in this table, and the first instruction of
+ * each pair is turned into a superinstruction doing the work of both with a
+ * single dispatch. Fusion rewrites only the opcode, so code addresses taken
+ * with 'here' by the compiling words stay valid and a jump to the second
+ * instruction still executes it on its own. Only code reachable from the
+ * start of the word is scanned, data compiled into a word is never touched.
+ * Rows are tried in order and a fused instruction is tried again, so rows can
+ * build on each other. To add a fusion, add the primitive with its layout in
+ * fused_layout[] and a row here */
+
+typedef struct
 {
-    if (addr < ZF_USERVAR_COUNT)
+    zf_prim first;  /* First instruction */
+    zf_prim second; /* Instruction following the first one */
+    int8_t operand; /* Required inline operand of both instructions, -1 for any */
+    zf_prim fused;  /* Superinstruction replacing the first instruction */
+} zf_fusion;
+
+static const zf_fusion fusions[] = {
+    {PRIM_LIT, PRIM_ADD, -1, PRIM_LIT_ADD},
+    {PRIM_LIT, PRIM_SUB, -1, PRIM_LIT_SUB},
+    {PRIM_LIT, PRIM_MUL, -1, PRIM_LIT_MUL},
+    {PRIM_LIT, PRIM_PICK, -1, PRIM_LIT_PICK},
+    {PRIM_LIT, PRIM_PICKR, -1, PRIM_LIT_PICKR},
+    {PRIM_LIT_PICK, PRIM_LIT_PICK, 1, PRIM_2DUP},
+    {PRIM_EQUAL, PRIM_JMP0, -1, PRIM_EQ_JMP0},
+    {PRIM_LTZ, PRIM_JMP0, -1, PRIM_LTZ_JMP0},
+};
+
+static ZF_THREAD_LOCAL uint8_t fuse_seen[ZF_ADDR_SPACE / 8];
+
+
+/**
+ * @brief  Replace the instruction at the given address by a superinstruction
+ *         if it and the following instruction match a row of fusions[]
+ * @param  addr: Address of the instruction
+ * @param  op: Primitive at addr
+ * @param  operand: Inline operand of the instruction at addr
+ * @param  next: Address of the following instruction
+ * @return 1 if the instruction was replaced, 0 otherwise
+ */
+static int fuse_pair(zf_addr addr, zf_addr op, zf_cell operand, zf_addr next)
+{
+    zf_addr op2;
+    zf_cell operand2;
+    size_t i;
+
+    if (next >= HERE)
     {
-        *val = uservar[addr];
-        return 1;
+        return 0;
     }
-    else
+
+    scan_decode(next, &op2, &operand2);
+
+    for (i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++)
     {
-        return dict_get_cell_typed(addr, val, (zf_mem_size)len);
+        const zf_fusion *f = &fusions[i];
+        if (f->first == op && f->second == op2 &&
+            (f->operand < 0 || (operand == f->operand && operand2 == f->operand)))
+        {
+            trace("\n fuse " ZF_ADDR_FMT " %s", addr, op_name(f->fused));
+            dict_put_cell(addr, f->fused);
+            return 1;
+        }
     }
+
+    return 0;
 }
 
 /**
- * @brief      Run primitive operation
- * @param      op: Operation to run
- * @param[in]  input: Input string
+ * @brief  Fuse instruction pairs in the code of a word
+ * @param  xt: Address of the code of the word
  * @return None
  */
-static void do_prim(zf_prim op, const char *input)
+static void fuse(zf_addr xt)
 {
-    zf_cell d1, d2, d3;
-    zf_addr addr, len;
+    zf_addr pending[ZF_SCAN_PENDING];
+    int changed;
 
-    trace("(%s) ", op_name(op));
+    /* A fusion may enable another one on the instruction before, so repeat
+     * until the code does not change anymore */
 
-    switch (op)
+    do
     {
-        case PRIM_COL:
-            if (input == NULL)
-            {
-                input_state = ZF_INPUT_PASS_WORD;
-            }
-            else
-            {
-                create(input, 0);
-                COMPILING = 1;
-            }
-            break;
+        int n = 0;
+        zf_addr a;
 
-        case PRIM_LTZ:
-            zf_push(zf_pop() < 0);
-            break;
+        changed = 0;
+        memset(fuse_seen, 0, sizeof(fuse_seen));
+        pending[n++] = xt;
 
-        case PRIM_SEMICOL:
-            dict_add_op(PRIM_EXIT);
-            trace("\n===");
-            COMPILING = 0;
-            break;
+        while (n > 0)
+        {
+            a = pending[--n];
 
-        case PRIM_LIT:
-            ip += dict_get_cell(ip, &d1);
-            zf_push(d1);
-            break;
+            while (a >= xt && a < HERE && !(fuse_seen[a / 8] & (1 << (a % 8))))
+            {
+                zf_addr op, len;
+                zf_cell operand;
 
-        case PRIM_EXIT:
-            ip = zf_popr();
-            break;
+                fuse_seen[a / 8] |= 1 << (a % 8);
+                len = scan_decode(a, &op, &operand);
 
-        case PRIM_LEN:
-            len = zf_pop();
-            addr = zf_pop();
-            zf_push(peek(addr, &d1, len));
-            break;
+                if (op < PRIM_COUNT && fuse_pair(a, op, operand, a + len))
+                {
+                    len = scan_decode(a, &op, &operand);
+                    changed = 1;
+                }
 
-        case PRIM_PEEK:
-            len = zf_pop();
-            addr = zf_pop();
-            peek(addr, &d1, len);
-            zf_push(d1);
-            break;
+                if (op == PRIM_EXIT || op == PRIM_LEAVE)
+                {
+                    break;
+                }
+                if (op == PRIM_JMP)
+                {
+                    a = operand;
+                    continue;
+                }
+                /* Targets which do not fit are not scanned, which only
+                 * means less fusion */
 
-        case PRIM_POKE:
-            d2 = zf_pop();
-            addr = zf_pop();
-            d1 = zf_pop();
-            if (addr < ZF_USERVAR_COUNT)
-            {
-                uservar[addr] = d1;
-                break;
+                if ((op == PRIM_JMP0 || op == PRIM_EQ_JMP0 || op == PRIM_LTZ_JMP0 ||
+                     op == PRIM_DO || op == PRIM_LOOP || op == PRIM_LOOPP) &&
+                    n < ZF_SCAN_PENDING)
+                {
+                    pending[n++] = operand;
+                }
+                a += len;
             }
-            dict_put_cell_typed(addr, d1, (zf_mem_size)d2);
-            break;
+        }
+    } while (changed);
+}
 
-        case PRIM_SWAP:
-            d1 = zf_pop();
-            d2 = zf_pop();
-            zf_push(d1);
-            zf_push(d2);
-            break;
+#endif
 
-        case PRIM_ROT:
-            d1 = zf_pop();
-            d2 = zf_pop();
-            d3 = zf_pop();
-            zf_push(d2);
-            zf_push(d1);
-            zf_push(d3);
-            break;
+#if ZF_ENABLE_VERIFY
 
-        case PRIM_DROP:
-            zf_pop();
-            break;
+/* Stack effect verification. When ';' closes a definition, verify() follows
+ * every path through the code of the word, tracking the depth of both stacks
+ * relative to the entry of the word. A word is verified if all paths agree on
+ * the stack depths wherever they meet and at every exit, the return stack is
+ * balanced at exit, and the word only uses primitives with a static stack
+ * effect and calls to verified words. The results are kept in a table keyed
+ * by execution token, since the word header has no room for another flag.
+ * When a verified word is called, the stack depths it needs are checked once
+ * and the word runs in run_verified(), which has no stack checks at all */
 
-        case PRIM_DUP:
-            d1 = zf_pop();
-            zf_push(d1);
-            zf_push(d1);
-            break;
+/* Stack depths at each instruction of the word being verified. Longer words
+ * are not verified */
 
-        case PRIM_ADD:
-            d1 = zf_pop();
-            d2 = zf_pop();
-            zf_push(d1 + d2);
-            break;
+#define ZF_VERIFY_CODE_MAX 256
 
-        case PRIM_SYS:
-            d1 = zf_pop();
-            input_state = zf_host_sys((zf_syscall_id)d1, input);
-            if (input_state != ZF_INPUT_INTERPRET)
-            {
-                zf_push(d1); /* re-push id to resume */
-            }
-            break;
+/* 'seen' is 2 for an unfused pick or pickr, which takes its argument from
+ * the literal before it and must not be reached any other way */
 
-        case PRIM_PICK:
-            addr = zf_pop();
-            zf_push(zf_pick(addr));
-            break;
+static ZF_THREAD_LOCAL struct
+{
+    uint8_t seen;
+    int8_t d;
+    uint8_t r;
+} verify_state[ZF_VERIFY_CODE_MAX];
 
-        case PRIM_PICKR:
-            addr = zf_pop();
-            zf_push(zf_pickr(addr));
-            break;
+/**
+ * @brief  Find the verification result of a word
+ * @param  xt: Execution token of the word
+ * @return Verification record, or NULL if the word is not verified
+ */
+static zf_verified *verify_find(zf_addr xt)
+{
+    zf_verified *v = &ctx->verified[xt & (ZF_VERIFY_SIZE - 1)];
+    return v->xt == xt ? v : NULL;
+}
 
-        case PRIM_SUB:
-            d1 = zf_pop();
-            d2 = zf_pop();
-            zf_push(d2 - d1);
-            break;
+/**
+ * @brief  Check if a word can be called through run_verified()
+ * @param  xt: Execution token of the word
+ * @param  dsp: Current data stack depth
+ * @param  rsp: Current return stack depth, before pushing the return address
+ * @return Verification record if the word is verified and the stacks have
+ *         room for it, NULL otherwise
+ */
+static zf_verified *verify_entry(zf_addr xt, zf_addr dsp, zf_addr rsp)
+{
+    zf_verified *v = verify_find(xt);
+    if (v && dsp >= v->need && dsp + v->max <= ctx->dstack_size &&
+        rsp + 1 + v->rmax <= ctx->rstack_size)
+    {
+        return v;
+    }
+    return NULL;
+}
 
-        case PRIM_MUL:
-            zf_push(zf_pop() * zf_pop());
-            break;
+/**
+ * @brief  Drop all verification results if the given range of the dictionary
+ *         holds code of a verified word
+ * @param  addr: Start of the range
+ * @param  len: Size of the range in bytes
+ * @return None
+ */
+static void verify_invalidate(zf_addr addr, size_t len)
+{
+    for (; len--; addr++)
+    {
+        if (ctx->verified_code[addr / 8] & (1 << (addr % 8)))
+        {
+            memset(ctx->verified, 0, sizeof(ctx->verified));
+            memset(ctx->verified_code, 0, sizeof(ctx->verified_code));
+            ctx->verify_dropped = 1;
+#if ZF_ENABLE_JIT
+            jit_reset();
+#endif
+            return;
+        }
+    }
+}
 
-        case PRIM_DIV:
-            if ((d2 = zf_pop()) == 0)
-            {
-                zf_abort(ZF_ABORT_DIVISION_BY_ZERO);
-            }
-            d1 = zf_pop();
-            zf_push(d1 / d2);
-            break;
+/**
+ * @brief  Verify the stack effect of a word
+ * @param  xt: Execution token of the word
+ * @param  end: End of the code of the word
+ * @return 1 if the word was verified, 0 otherwise
+ */
+static int verify(zf_addr xt, zf_addr end)
+{
+    zf_addr pending[ZF_SCAN_PENDING];
+    int pending_d[ZF_SCAN_PENDING], pending_r[ZF_SCAN_PENDING];
+    int n = 0, lo = 0, hi = 0, rhi = 0, net = 0, exits = 0;
+    zf_verified *v;
+    zf_addr a, op, len, prev;
+    zf_cell operand, prev_operand;
+
+    if (end <= xt || end - xt > ZF_VERIFY_CODE_MAX)
+    {
+        return 0;
+    }
 
-        case PRIM_MOD:
-            if ((int)(d2 = zf_pop()) == 0)
-            {
-                zf_abort(ZF_ABORT_DIVISION_BY_ZERO);
-            }
-            d1 = zf_pop();
-            zf_push((int)d1 % (int)d2);
-            break;
+    memset(verify_state, 0, sizeof(verify_state));
+    pending[n] = xt;
+    pending_d[n] = 0;
+    pending_r[n++] = 0;
 
-        case PRIM_IMMEDIATE:
-            make_immediate();
-            break;
+    while (n > 0)
+    {
+        int d, r;
 
-        case PRIM_JMP:
-            ip += dict_get_cell(ip, &d1);
-            trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ip, (zf_addr)d1);
-            ip = d1;
-            break;
+        n--;
+        a = pending[n];
+        d = pending_d[n];
+        r = pending_r[n];
+        prev = PRIM_JMP;
+        prev_operand = -1;
 
-        case PRIM_JMP0:
-            ip += dict_get_cell(ip, &d1);
-            if (zf_pop() == 0)
-            {
-                trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ip, (zf_addr)d1);
-                ip = d1;
-            }
-            break;
+        for (;;)
+        {
+            int pop = 0, push = 0, branch = 0;
 
-        case PRIM_TICK:
-            if (COMPILING)
+            if (a < xt || a >= end || d < -100 || d > 100 || r > 100)
             {
-                ip += dict_get_cell(ip, &d1);
-                trace("%s/", op_name(d1));
-                zf_push(d1);
+                return 0;
             }
-            else
+            if (verify_state[a - xt].seen)
             {
-                if (input)
+                if (verify_state[a - xt].d != d || verify_state[a - xt].r != r ||
+                    verify_state[a - xt].seen == 2)
                 {
-                    if (find_word(input, &addr, &len))
-                        zf_push(len);
-                    else
-                        zf_abort(ZF_ABORT_INTERNAL_ERROR);
+                    return 0;
                 }
-                else
-                    input_state = ZF_INPUT_PASS_WORD;
+                break;
             }
-            break;
+            verify_state[a - xt].seen = 1;
+            verify_state[a - xt].d = d;
+            verify_state[a - xt].r = r;
 
-        case PRIM_COMMA:
-            d2 = zf_pop();
-            d1 = zf_pop();
-            dict_add_cell_typed(d1, (zf_mem_size)d2);
-            break;
+            len = scan_decode(a, &op, &operand);
 
-        case PRIM_COMMENT:
-            if (!input || input[0] != ')')
+            if (op >= PRIM_COUNT)
             {
-                input_state = ZF_INPUT_PASS_CHAR;
+                zf_verified *c = verify_find(op);
+                if (c == NULL)
+                {
+                    return 0;
+                }
+                lo = d - c->need < lo ? d - c->need : lo;
+                hi = d + c->max > hi ? d + c->max : hi;
+                rhi = r + 1 + c->rmax > rhi ? r + 1 + c->rmax : rhi;
+                d += c->net;
+                prev = op;
+                a += len;
+                continue;
             }
-            break;
-
-        case PRIM_PUSHR:
-            zf_pushr(zf_pop());
-            break;
-
-        case PRIM_POPR:
-            zf_push(zf_popr());
-            break;
 
-        case PRIM_EQUAL:
-            zf_push(zf_pop() == zf_pop());
-            break;
-
-        case PRIM_KEY:
-            if (input == NULL)
+            switch (op)
             {
-                input_state = ZF_INPUT_PASS_CHAR;
+            case PRIM_EXIT:
+                if (r != 0 || (exits && net != d))
+                {
+                    return 0;
+                }
+                net = d;
+                exits = 1;
+                break;
+            case PRIM_JMP:
+                prev = op;
+                a = operand;
+                continue;
+            case PRIM_JMP0:
+#if ZF_ENABLE_FUSION
+            case PRIM_LTZ_JMP0:
+#endif
+                pop = 1;
+                branch = 1;
+                break;
+            case PRIM_DROP:
+                pop = 1;
+                break;
+            case PRIM_LTZ:
+#if ZF_ENABLE_FUSION
+            case PRIM_LIT_ADD:
+            case PRIM_LIT_SUB:
+            case PRIM_LIT_MUL:
+#endif
+                pop = push = 1;
+                break;
+            case PRIM_ADD:
+            case PRIM_SUB:
+            case PRIM_MUL:
+            case PRIM_DIV:
+            case PRIM_MOD:
+            case PRIM_EQUAL:
+            case PRIM_AND:
+            case PRIM_OR:
+            case PRIM_XOR:
+            case PRIM_SHL:
+            case PRIM_SHR:
+            case PRIM_PEEK:
+            case PRIM_LEN:
+                pop = 2;
+                push = 1;
+                break;
+            case PRIM_LIT:
+            case PRIM_I:
+                push = 1;
+                break;
+            case PRIM_DUP:
+                pop = 1;
+                push = 2;
+                break;
+            case PRIM_SWAP:
+                pop = push = 2;
+                break;
+            case PRIM_ROT:
+                pop = push = 3;
+                break;
+            case PRIM_POKE:
+                pop = 3;
+                break;
+            case PRIM_COMMA:
+                pop = 2;
+                break;
+            case PRIM_LITS:
+                push = 2;
+                break;
+            case PRIM_PUSHR:
+                pop = 1;
+                r += 1;
+                break;
+            case PRIM_POPR:
+                if (r < 1)
+                {
+                    return 0;
+                }
+                push = 1;
+                r -= 1;
+                break;
+            case PRIM_J:
+                if (r < 3)
+                {
+                    return 0;
+                }
+                push = 1;
+                break;
+            case PRIM_DO:
+                pop = 2;
+                r += 3;
+                break;
+            case PRIM_LOOPP:
+                pop = 1;
+                /* fall through */
+            case PRIM_LOOP:
+            case PRIM_UNLOOP:
+                if (r < 3)
+                {
+                    return 0;
+                }
+                branch = (op != PRIM_UNLOOP);
+                break;
+            case PRIM_PICK:
+                if (prev != PRIM_LIT || prev_operand < 0)
+                {
+                    return 0;
+                }
+                lo = d - prev_operand - 2 < lo ? d - prev_operand - 2 : lo;
+                verify_state[a - xt].seen = 2;
+                pop = push = 1;
+                break;
+            case PRIM_PICKR:
+                if (prev != PRIM_LIT || prev_operand < 0 || prev_operand > r)
+                {
+                    return 0;
+                }
+                verify_state[a - xt].seen = 2;
+                pop = push = 1;
+                break;
+#if ZF_ENABLE_FUSION
+            case PRIM_LIT_PICK:
+                if (operand < 0)
+                {
+                    return 0;
+                }
+                lo = d - operand - 1 < lo ? d - operand - 1 : lo;
+                push = 1;
+                break;
+            case PRIM_LIT_PICKR:
+                if (operand < 0 || operand > r)
+                {
+                    return 0;
+                }
+                push = 1;
+                break;
+            case PRIM_2DUP:
+                pop = 2;
+                push = 4;
+                break;
+            case PRIM_EQ_JMP0:
+                pop = 2;
+                branch = 1;
+                break;
+#endif
+            default:
+                return 0;
             }
-            else
+
+            if (op == PRIM_EXIT)
             {
-                zf_push(input[0]);
+                break;
             }
-            break;
 
-        case PRIM_LITS:
-            ip += dict_get_cell(ip, &d1);
-            zf_push(ip);
-            zf_push(d1);
-            ip += d1;
-            break;
+            d -= pop;
+            lo = d < lo ? d : lo;
+            d += push;
+            hi = d > hi ? d : hi;
+            rhi = r > rhi ? r : rhi;
 
-        case PRIM_AND:
-            zf_push((zf_int)zf_pop() & (zf_int)zf_pop());
-            break;
+            if (branch)
+            {
+                if (n == ZF_SCAN_PENDING)
+                {
+                    return 0;
+                }
+                pending[n] = operand;
+                pending_d[n] = d;
+                pending_r[n++] = r;
+            }
 
-        case PRIM_OR:
-            zf_push((zf_int)zf_pop() | (zf_int)zf_pop());
-            break;
+            /* Falling out of a loop drops its parameters */
 
-        case PRIM_XOR:
-            zf_push((zf_int)zf_pop() ^ (zf_int)zf_pop());
-            break;
+            if (op == PRIM_LOOP || op == PRIM_LOOPP || op == PRIM_UNLOOP)
+            {
+                r -= 3;
+            }
 
-        case PRIM_SHL:
-            d1 = zf_pop();
-            zf_push((zf_int)zf_pop() << (zf_int)d1);
-            break;
+            prev = op;
+            prev_operand = operand;
+            a += len;
+        }
+    }
 
-        case PRIM_SHR:
-            d1 = zf_pop();
-            zf_push((zf_int)zf_pop() >> (zf_int)d1);
-            break;
+    if (!exits || -lo > 255 || hi > 255 || rhi > 255)
+    {
+        return 0;
+    }
 
-        default:
-            zf_abort(ZF_ABORT_INTERNAL_ERROR);
-            break;
+    for (a = xt; a < end; a++)
+    {
+        if (verify_state[a - xt].seen)
+        {
+            zf_addr b, l = scan_decode(a, &op, &operand);
+            for (b = a; b < a + l; b++)
+            {
+                ctx->verified_code[b / 8] |= 1 << (b % 8);
+            }
+        }
+    }
+
+    v = &ctx->verified[xt & (ZF_VERIFY_SIZE - 1)];
+    if (v->xt != xt)
+    {
+        memset(v, 0, sizeof(*v));
     }
+    v->xt = xt;
+    v->need = -lo;
+    v->max = hi;
+    v->rmax = rhi;
+    v->net = net;
+    trace("\n verified " ZF_ADDR_FMT " need %d max %d rmax %d net %d", xt, -lo, hi, rhi, net);
+    return 1;
 }
 
 /**
- * @brief     Handle incoming word. Compile or interpreted the word, or pass it to a
- *            deferred primitive if it requested a word from the input stream.
- * @param[in] buf: null-terminated string to handle
+ * @brief  Verify all words in the dictionary, for example after loading an
+ *         image. Words are verified again until no more words pass, since
+ *         a word can only pass after the words it calls
+ * @param  None
  * @return None
  */
-static void handle_word(const char *buf)
+static void verify_all(void)
 {
-    zf_addr w, c = 0;
-    int found;
-
-    /* If a word was requested by an earlier operation, resume with the new word */
-
-    if (input_state == ZF_INPUT_PASS_WORD)
-    {
-        input_state = ZF_INPUT_INTERPRET;
-        run(buf);
-        return;
-    }
-
-    /* Look up the word in the dictionary */
+    int changed;
 
-    found = find_word(buf, &w, &c);
+    memset(ctx->verified, 0, sizeof(ctx->verified));
+    memset(ctx->verified_code, 0, sizeof(ctx->verified_code));
+#if ZF_ENABLE_JIT
+    jit_reset();
+#endif
 
-    if (found)
+    do
     {
+        zf_addr w = LATEST, end = HERE;
+        changed = 0;
 
-        /* Word found: compile or execute, depending on flags and state */
+        while (w)
+        {
+            zf_cell d, link;
+            zf_addr xt, p = w;
+            p += dict_get_cell(p, &d);
+            dict_get_cell(p, &link);
+            xt = word_xt(w);
 
-        zf_cell d;
-        int flags;
-        dict_get_cell(w, &d);
-        flags = d;
+            /* Words sharing a record would keep replacing each other, so
+             * only free records are filled */
 
-        if (COMPILING && (POSTPONE || !(flags & ZF_FLAG_IMMEDIATE)))
-        {
-            if (flags & ZF_FLAG_PRIM)
-            {
-                dict_get_cell(c, &d);
-                dict_add_op(d);
-            }
-            else
+            if (!((int)d & ZF_FLAG_PRIM) && ctx->verified[xt & (ZF_VERIFY_SIZE - 1)].xt == 0 && verify(xt, end))
             {
-                dict_add_op(c);
+                changed = 1;
             }
-            POSTPONE = 0;
-        }
-        else
-        {
-            execute(c);
+            end = w;
+            w = link;
+        }
+    } while (changed);
+}
+
+#endif
+
+static zf_addr peek(zf_addr addr, zf_cell *val, int len)
+{
+    if (addr < ZF_USERVAR_COUNT)
+    {
+        *val = ctx->uservar[addr];
+        return 1;
+    }
+    else
+    {
+        return dict_get_cell_typed(addr, val, (zf_mem_size)len);
+    }
+}
+
+static void poke(zf_addr addr, zf_cell val, int len)
+{
+    if (addr < ZF_USERVAR_COUNT)
+    {
+        ctx->uservar[addr] = val;
+    }
+    else
+    {
+        dict_put_cell_typed(addr, val, (zf_mem_size)len);
+    }
+}
+
+#if ZF_ENABLE_TASKS
+
+/**
+ * @brief  Find the next task in round robin order
+ * @param  None
+ * @return Index of the task, the running one if there is no other task
+ */
+static zf_addr task_next(void)
+{
+    zf_addr n = ctx->task;
+    do
+    {
+        n = (n + 1) % ZF_TASKS_MAX;
+    } while (ctx->tasks[n].dstack == NULL);
+    return n;
+}
+
+/**
+ * @brief  Save the state of the running task and switch the context to
+ *         another one. The caller saves and loads the state of run()
+ * @param  next: Index of the task to switch to
+ * @return None
+ */
+static void task_switch(zf_addr next)
+{
+    zf_task *t = &ctx->tasks[ctx->task];
+
+    t->dstack = ctx->dstack;
+    t->dstack_size = ctx->dstack_size;
+    t->rstack = ctx->rstack;
+    t->rstack_size = ctx->rstack_size;
+    t->dsp = DSP;
+    t->rsp = RSP;
+    t->ip = ctx->ip;
+
+    t = &ctx->tasks[next];
+    trace("\n task %d", (int)next);
+    ctx->task = next;
+    ctx->dstack = t->dstack;
+    ctx->dstack_size = t->dstack_size;
+#if ZF_ENABLE_TOS_CACHE
+    ctx->dstack_mem = t->dstack - 1;
+#endif
+    ctx->rstack = t->rstack;
+    ctx->rstack_size = t->rstack_size;
+    DSP = t->dsp;
+    RSP = t->rsp;
+    ctx->ip = t->ip;
+}
+
+/**
+ * @brief  Remove the running task, unless it is task 0, and switch to another
+ * @param  next: Index of the task to switch to
+ * @return 1 if the task was removed, 0 if it is task 0
+ */
+static int task_drop(zf_addr next)
+{
+    zf_addr t = ctx->task;
+
+    if (t == 0)
+    {
+        return 0;
+    }
+    task_switch(next);
+    ctx->tasks[t].dstack = NULL;
+    return 1;
+}
+
+/**
+ * @brief  Switch a context back to task 0 when its evaluation returns to the
+ *         host from another task, which yielded, suspended or waits for
+ *         input, so the host API always works on the stacks of task 0. The
+ *         task is switched back to when the evaluation is resumed. Nested
+ *         evaluations, from a syscall, stay with the running task
+ * @param  c: Context
+ * @return None
+ */
+static void task_park(zf_ctx *c)
+{
+    zf_ctx *prev = ctx;
+
+    if (c->task != 0 && !c->jmpbuf)
+    {
+        ctx = c;
+        c->task_parked = c->task;
+        task_switch(0);
+        ctx = prev;
+    }
+}
+
+/**
+ * @brief  Switch a context back to the task parked by task_park()
+ * @param  c: Context
+ * @return None
+ */
+static void task_unpark(zf_ctx *c)
+{
+    zf_ctx *prev = ctx;
+
+    if (c->task_parked != 0)
+    {
+        ctx = c;
+        task_switch(c->task_parked);
+        c->task_parked = 0;
+        ctx = prev;
+    }
+}
+
+/* A task returning from its word continues with the next task, task 0
+ * returns to the host */
+
+#define TASK_END()               \
+    if (!task_drop(task_next())) \
+        return;                  \
+    LOAD();
+
+#else
+
+#define TASK_END() return;
+
+#endif
+
+#if ZF_ENABLE_CHANNELS
+
+/**
+ * @brief  Get the channel attached to the current context with the given id
+ * @param  id: Channel id
+ * @return Channel
+ */
+static zf_chan *chan_get(zf_addr id)
+{
+    CHECK(id < ZF_CHANNELS_MAX && ctx->chans[id], ZF_ABORT_OUTSIDE_MEM);
+    return ctx->chans[id];
+}
+
+#endif
+
+/* The inner interpreter can dispatch primitives in two ways. The portable way
+ * is a switch statement inside the interpreter loop. On compilers supporting
+ * labels as values (GCC, clang) ZF_ENABLE_COMPUTED_GOTO replaces the switch
+ * with a table of label addresses and every primitive ends by fetching and
+ * jumping to the next one directly, giving one indirect jump per primitive.
+ * The primitive implementations are shared between both variants through the
+ * PRIM() and NEXT macros below. */
+
+#if ZF_ENABLE_COMPUTED_GOTO
+#define PRIM(op) L_##op:
+#define NEXT                     \
+    do                           \
+    {                            \
+        FETCH();                 \
+        goto *prim_labels[code]; \
+    } while (0)
+#else
+#define PRIM(op) case op:
+#define NEXT     continue
+#endif
+
+/* Decode the instruction at ip and advance ip to the next one. OPERAND() gets
+ * the inline operand of primitives which have one, which the cached decoder has
+ * already read and skipped */
+
+#if ZF_ENABLE_DECODE_CACHE
+#define DECODE()                                                   \
+    dc = &ctx->decode_cache[ctx->ip & (ZF_DECODE_CACHE_SIZE - 1)]; \
+    if (dc->addr != ctx->ip)                                       \
+        decode(dc, ctx->ip);                                       \
+    code = dc->code;                                               \
+    ctx->ip = dc->next;
+#define OPERAND(v) v = dc->operand
+#else
+#define DECODE()                            \
+    ctx->ip += dict_get_cell(ctx->ip, &d1); \
+    code = d1;
+#define OPERAND(v) ctx->ip += dict_get_cell(ctx->ip, &v)
+#endif
+
+/* Superinstructions get their operand with FUSED_OPERAND() or, if they have
+ * none, skip over the instructions they replace with FUSED_SKIP(). Both are
+ * handled by the cached decoder already */
+
+#if ZF_ENABLE_DECODE_CACHE
+#define FUSED_OPERAND(op, v) v = dc->operand
+#define FUSED_SKIP(op)
+#else
+#define FUSED_OPERAND(op, v)                        \
+    ctx->ip += fused_layout[(op) - PRIM_FUSED].pre; \
+    ctx->ip += dict_get_cell(ctx->ip, &v);          \
+    ctx->ip += fused_layout[(op) - PRIM_FUSED].post
+#define FUSED_SKIP(op) ctx->ip += fused_layout[(op) - PRIM_FUSED].pre
+#endif
+
+/* Stack access from within the inner interpreter. With ZF_ENABLE_TOS_CACHE the
+ * top of the data stack is kept in the local 'tos' and both stack pointers in
+ * the locals 'dsp' and 'rsp' while run() executes; the remaining stack
+ * elements stay in memory. SAVE() writes this state back to the stacks and
+ * user variables, LOAD() reads it again. The state must be saved whenever
+ * code outside of run() may look at the stacks, i.e. before syscalls and
+ * access to user variables, and before returning from run(). There is no
+ * need to save on aborts, since zf_eval() resets both stacks anyway. Without
+ * the cache these macros map onto the regular stack functions. */
+
+#if ZF_ENABLE_TOS_CACHE
+
+#define POP(v)                                          \
+    do                                                  \
+    {                                                   \
+        STACK_CHECK(dsp > 0, ZF_ABORT_DSTACK_UNDERRUN); \
+        v = tos;                                        \
+        tos = ctx->dstack_mem[--dsp];                   \
+        trace("«" ZF_CELL_FMT " ", (zf_cell)v);         \
+    } while (0)
+
+#define PUSH(v)                                                       \
+    do                                                                \
+    {                                                                 \
+        zf_cell v_ = (v);                                             \
+        STACK_CHECK(dsp < ctx->dstack_size, ZF_ABORT_DSTACK_OVERRUN); \
+        trace("»" ZF_CELL_FMT " ", v_);                               \
+        ctx->dstack_mem[dsp++] = tos;                                 \
+        tos = v_;                                                     \
+    } while (0)
+
+#define PICK(v, n)                                        \
+    do                                                    \
+    {                                                     \
+        STACK_CHECK((n) < dsp, ZF_ABORT_DSTACK_UNDERRUN); \
+        v = (n) ? ctx->dstack_mem[dsp - (n)] : tos;       \
+    } while (0)
+
+#define PUSHR(v)                                                      \
+    do                                                                \
+    {                                                                 \
+        STACK_CHECK(rsp < ctx->rstack_size, ZF_ABORT_RSTACK_OVERRUN); \
+        trace("r»" ZF_CELL_FMT " ", (zf_cell)(v));                    \
+        ctx->rstack[rsp++] = (v);                                     \
+    } while (0)
+
+#define POPR(v)                                         \
+    do                                                  \
+    {                                                   \
+        STACK_CHECK(rsp > 0, ZF_ABORT_RSTACK_UNDERRUN); \
+        v = ctx->rstack[--rsp];                         \
+        trace("r«" ZF_CELL_FMT " ", (zf_cell)v);        \
+    } while (0)
+
+#define PICKR(v, n)                                       \
+    do                                                    \
+    {                                                     \
+        STACK_CHECK((n) < rsp, ZF_ABORT_RSTACK_UNDERRUN); \
+        v = ctx->rstack[rsp - (n) - 1];                   \
+    } while (0)
+
+#define SAVE()                      \
+    do                              \
+    {                               \
+        ctx->dstack_mem[dsp] = tos; \
+        DSP = dsp;                  \
+        RSP = rsp;                  \
+    } while (0)
+
+#define LOAD()                      \
+    do                              \
+    {                               \
+        dsp = DSP;                  \
+        rsp = RSP;                  \
+        tos = ctx->dstack_mem[dsp]; \
+    } while (0)
+
+#define RDEPTH rsp
+
+#else
+
+#define POP(v)      v = zf_pop()
+#define PUSH(v)     zf_push(v)
+#define PICK(v, n)  v = zf_pick(n)
+#define PUSHR(v)    zf_pushr(v)
+#define POPR(v)     v = zf_popr()
+#define PICKR(v, n) v = zf_pickr(n)
+#define SAVE()
+#define LOAD()
+#define RDEPTH RSP
+
+#endif
+
+/* True if a memory access touches the user variables, either through their
+ * pseudo-indices or through the dictionary bytes they are stored in */
+
+#define IS_USERVAR(addr) ((addr) < ZF_USERVAR_COUNT * sizeof(zf_addr))
+
+/* Count an instruction against the budget of zf_ctx_run_steps(), and leave
+ * the interpreter with ip at the instruction when the budget ran out. A
+ * primitive which got input passed in runs first, so the input is not lost.
+ * The budget stays exhausted, so run() also returns after run_verified() */
+
+#if ZF_ENABLE_YIELD
+#define YIELD_CHECK()                                \
+    if (ctx->steps != 0 && --ctx->steps == 0)        \
+    {                                                \
+        ctx->steps = 1;                              \
+        if (!INPUT_PENDING)                          \
+        {                                            \
+            ctx->yielded = 1;                        \
+            SAVE();                                  \
+            return;                                  \
+        }                                            \
+    }
+#else
+#define YIELD_CHECK()
+#endif
+
+/* Fetch the next cell at ip. Exits the interpreter when ip is zero, unless a
+ * task other than task 0 returned, or when the instruction budget ran out,
+ * and jumps to the call handler when the cell is not a primitive */
+
+#define FETCH()                                                 \
+    if (ctx->ip == 0)                                           \
+    {                                                           \
+        SAVE();                                                 \
+        TASK_END();                                             \
+    }                                                           \
+    YIELD_CHECK();                                              \
+    ip_org = ctx->ip;                                           \
+    DECODE();                                                   \
+    trace("\n " ZF_ADDR_FMT " " ZF_ADDR_FMT " ", ip_org, code); \
+    for (i = 0; i < RDEPTH; i++)                                \
+        trace("┊  ");                                           \
+    if (code >= PRIM_COUNT)                                     \
+        goto call;                                              \
+    trace("(%s) ", op_name(code));
+
+/* Suspend the current primitive until the next word or character is available
+ * from the input. The interpreter is left with ip pointing to the primitive so
+ * that it is called again when run() is resumed with the input */
+
+#define REQUEST_INPUT(state)    \
+    ctx->input_state = (state); \
+    ctx->ip = ip_org;           \
+    SAVE();                     \
+    return;
+
+/* Wait for a channel which is full or empty, with the operands of the
+ * primitive back on the stack. The primitive is retried after the other
+ * tasks had a turn; once every task waited in a row, the evaluation yields
+ * to the host, which can run the contexts on the other side of the channels
+ * before resuming it */
+
+#if ZF_ENABLE_CHANNELS
+#if ZF_ENABLE_TASKS
+#define CHAN_WAIT_TASKS()                       \
+    if (ctx->chan_waits++ < ZF_TASKS_MAX)       \
+    {                                           \
+        task_switch(task_next());               \
+        LOAD();                                 \
+        NEXT;                                   \
+    }
+#else
+#define CHAN_WAIT_TASKS()
+#endif
+#define CHAN_WAIT()         \
+    ctx->ip = ip_org;       \
+    SAVE();                 \
+    CHAN_WAIT_TASKS();      \
+    ctx->chan_waits = 0;    \
+    ctx->yielded = 1;       \
+    return;
+#endif
+
+#if ZF_ENABLE_JIT
+#include "zforth_jit.h"
+#endif
+
+#if ZF_ENABLE_AOT && ZF_ENABLE_VERIFY
+#include "zforth_aot.h"
+#endif
+
+#define RUN_VERIFIED 0
+#include "zforth_run.h"
+#if ZF_ENABLE_VERIFY
+#undef RUN_VERIFIED
+#define RUN_VERIFIED 1
+#include "zforth_run.h"
+#endif
+
+/**
+ * @brief  Execute bytecode from given address
+ * @param  addr: Address to execute
+ * @return None
+ */
+static void execute(zf_addr addr)
+{
+    ctx->ip = addr;
+    RSP = 0;
+    zf_pushr(0);
+
+    trace("\n[%s/" ZF_ADDR_FMT "] ", op_name(ctx->ip), ctx->ip);
+#if ZF_ENABLE_VERIFY
+    if (verify_entry(addr, DSP, 0))
+    {
+        run_verified(0);
+    }
+#endif
+    run(NULL);
+}
+
+/**
+ * @brief     Copy a word from the input to the token buffer, for the
+ *            functions which take a null-terminated string: primitives
+ *            reading the next word, and zf_host_parse_num(). The buffer
+ *            holds the longest name a word can have
+ * @param[in] buf: Word
+ * @param     len: Length of the word
+ * @return    Null-terminated copy of the word. Aborts if it does not fit
+ */
+static const char *token(const char *buf, size_t len)
+{
+    if (len > sizeof(ctx->token) - 1)
+    {
+        zf_abort(ZF_ABORT_INVALID_SIZE);
+    }
+    memcpy(ctx->token, buf, len);
+    ctx->token[len] = '\0';
+    return ctx->token;
+}
+
+#if ZF_ENABLE_PARSE_NUM
+
+/**
+ * @brief      Convert a word to a number without calling the host. Integers
+ *             may have a '0x' or '$' prefix for hexadecimal and '0b' for
+ *             binary, and wrap around at the size of zf_cell. With a float
+ *             or double zf_cell, decimal numbers may have a fraction and an
+ *             exponent; they are only converted here if the result is exact
+ *             after a single rounding
+ * @param[in]  buf: Word
+ * @param      len: Length of the word
+ * @param[out] v: Number
+ * @return     1 if the word was converted, 0 if it is left to the host
+ */
+static int parse_num(const char *buf, size_t len, zf_cell *v)
+{
+    const char *p = buf, *end = buf + len;
+    uint64_t m = 0;
+    unsigned base = 10, d;
+    int neg = 0, big = 0, digits = 0, exp = 0, e = 0, esign = 1;
+    int mant = sizeof(double) == sizeof(uint64_t) ? 53 : 24;
+    int pow_max = sizeof(double) == sizeof(uint64_t) ? 22 : 10;
+    double f, p10 = 1;
+    uint64_t bits;
+
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        neg = *p++ == '-';
+    }
+    if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x')
+    {
+        base = 16;
+        p += 2;
+    }
+    else if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'b')
+    {
+        base = 2;
+        p += 2;
+    }
+    else if (end - p > 1 && p[0] == '$')
+    {
+        base = 16;
+        p++;
+    }
+
+    for (; p < end; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            d = *p - '0';
+        }
+        else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+        {
+            d = (*p | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            break;
+        }
+        if (d >= base)
+        {
+            break;
+        }
+        big |= m > ((uint64_t)-1 - d) / base;
+        m = m * base + d;
+        digits++;
+    }
+
+    if ((zf_cell)0.5 == 0)
+    {
+        if (p != end || digits == 0)
+        {
+            return 0;
+        }
+        *v = (zf_cell)(neg ? 0 - m : m);
+        return 1;
+    }
+
+    /* Fraction and exponent of a float. If the mantissa and the power of
+     * ten are both exact in a double, one multiplication or division rounds
+     * the number correctly; anything else goes to the host, which knows how
+     * to round it */
+
+    if (base == 10 && p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+            big |= m > ((uint64_t)-1 - 9) / 10;
+            m = m * 10 + (*p - '0');
+            digits++;
+            exp--;
+        }
+    }
+    if (base == 10 && digits > 0 && p < end && (*p | 0x20) == 'e')
+    {
+        if (++p < end && (*p == '-' || *p == '+'))
+        {
+            esign = *p++ == '-' ? -1 : 1;
+        }
+        if (p == end)
+        {
+            return 0;
+        }
+        for (; p < end && *p >= '0' && *p <= '9' && e < 1000; p++)
+        {
+            e = e * 10 + (*p - '0');
+        }
+        exp += esign * e;
+    }
+    if (p != end || digits == 0 || big || m > (uint64_t)1 << mant || exp > pow_max || exp < -pow_max ||
+        sizeof(zf_cell) > sizeof(double) || FLT_EVAL_METHOD != 0)
+    {
+        return 0;
+    }
+    for (e = exp < 0 ? -exp : exp; e > 0; e--)
+    {
+        p10 *= 10;
+    }
+    f = (double)m;
+    f = exp < 0 ? f / p10 : f * p10;
+
+    /* Rounding the double to a float cell again is only wrong if the double
+     * is halfway between two floats */
+
+    if (sizeof(zf_cell) < sizeof(double))
+    {
+        memcpy(&bits, &f, sizeof(f));
+        if ((bits & 0x1fffffff) == 0x10000000)
+        {
+            return 0;
+        }
+    }
+    *v = (zf_cell)(neg ? -f : f);
+    return 1;
+}
+
+#endif
+
+/**
+ * @brief     Handle incoming word. Compile or interpreted the word, or pass it to a
+ *            deferred primitive if it requested a word from the input stream.
+ * @param[in] buf: Word to handle, not null-terminated
+ * @param     len: Length of the word
+ * @return None
+ */
+static void handle_word(const char *buf, size_t len)
+{
+    zf_addr w, c = 0;
+    int found;
+
+    /* If a word was requested by an earlier operation, resume with the new word */
+
+    if (ctx->input_state == ZF_INPUT_PASS_WORD)
+    {
+        ctx->input_state = ZF_INPUT_INTERPRET;
+        run(token(buf, len));
+        return;
+    }
+
+    /* Look up the word in the dictionary */
+
+    found = find_word(buf, len, &w, &c);
+
+    if (found)
+    {
+
+        /* Word found: compile or execute, depending on flags and state */
+
+        zf_cell d;
+        int flags;
+        dict_get_cell(w, &d);
+        flags = d;
+
+        if (COMPILING && (POSTPONE || !(flags & ZF_FLAG_IMMEDIATE)))
+        {
+            if (flags & ZF_FLAG_PRIM)
+            {
+                dict_get_cell(c, &d);
+                dict_add_op(d);
+#if ZF_ENABLE_INLINE
+                if (d == PRIM_TICK)
+                {
+                    ctx->inline_tick = HERE;
+                }
+#endif
+            }
+            else
+            {
+#if ZF_ENABLE_INLINE
+                if (!inline_word(w, c))
+#endif
+                    dict_add_op(c);
+            }
+            POSTPONE = 0;
+        }
+        else
+        {
+            execute(c);
         }
     }
     else
@@ -997,7 +2621,12 @@ static void handle_word(const char *buf)
         /* Word not found: try to convert to a number and compile or push, depending
          * on state */
 
-        zf_cell v = zf_host_parse_num(buf);
+        zf_cell v;
+
+#if ZF_ENABLE_PARSE_NUM
+        if (!parse_num(buf, len, &v))
+#endif
+            v = zf_host_parse_num(token(buf, len));
 
         if (COMPILING)
         {
@@ -1010,54 +2639,546 @@ static void handle_word(const char *buf)
     }
 }
 
+/* Characters which separate words: NUL and white space. Anything above ' '
+ * is part of a word */
+
+#define IS_DELIM(c) ((unsigned char)(c) <= ' ' && ((c) == '\0' || isspace(c)))
+
+/**
+ * @brief     Find the end of a word. Like memchr(), the input is scanned a
+ *            machine word at a time while none of its bytes is below 0x21;
+ *            the test sets the top bit of the first byte below 0x21. Words
+ *            with a byte below 0x21 are finished one byte at a time
+ * @param[in] p: Start of the word
+ * @param[in] end: End of the input
+ * @return    Delimiter after the word, or the end of the input
+ */
+static const char *word_end(const char *p, const char *end)
+{
+    const size_t ones = (size_t)-1 / 0xff;
+    size_t x;
+
+    while ((size_t)(end - p) >= sizeof(x))
+    {
+        memcpy(&x, p, sizeof(x));
+        if ((x - ones * 0x21) & ~x & (ones * 0x80))
+        {
+            break;
+        }
+        p += sizeof(x);
+    }
+    while (p < end && !IS_DELIM(*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @brief     Evaluate the input in 'src' in the current context. The input is
+ *            split into words, which are passed to handle_word() without
+ *            copying them, unless a deferred primitive requested the next
+ *            character from the input. The end of the input ends the last
+ *            word, and is passed on as a NUL character if one was requested.
+ *            The offset of every word is kept in 'src_pos' for error reports
+ * @param[in] unused: Unused
+ * @return    None
+ */
+static void eval(const char *unused)
+{
+    const char *buf = ctx->src, *end = buf + ctx->src_len, *base = ctx->src_base, *p;
+    char c;
+
+    for (;;)
+    {
+        if (ctx->input_state == ZF_INPUT_PASS_CHAR)
+        {
+            c = buf < end ? *buf : '\0';
+            ctx->src_pos = buf - base;
+            ctx->input_state = ZF_INPUT_INTERPRET;
+            run(&c);
+            p = buf;
+        }
+        else
+        {
+            while (buf < end && IS_DELIM(*buf))
+            {
+                buf++;
+            }
+            if (buf == end)
+            {
+                break;
+            }
+            p = word_end(buf + 1, end);
+            ctx->src_pos = buf - base;
+            handle_word(buf, p - buf);
+        }
+
+        /* p is at the character which ended the word, or which was passed
+         * on, and has been consumed */
+
+        if (p == end)
+        {
+            break;
+        }
+        buf = p + 1;
+#if ZF_ENABLE_YIELD
+        if (ctx->yielded)
+        {
+            ctx->src = buf;
+            ctx->src_len = end - buf;
+            ctx->src_base = base;
+            return;
+        }
+#endif
+    }
+    ctx->src = NULL;
+    ctx->src_pos = end - base;
+}
+
+/**
+ * @brief     Execute a word, for ctx_call()
+ * @param[in] arg: Execution token of the word, as a zf_addr
+ * @return    None
+ */
+static void execute_xt(const char *arg)
+{
+    zf_addr xt;
+    memcpy(&xt, arg, sizeof(xt));
+    execute(xt);
+}
+
+#if ZF_ENABLE_YIELD
+
+/**
+ * @brief     Resume an evaluation which ran out of its instruction budget:
+ *            continue the interrupted word, then the rest of the input
+ * @param[in] unused: Unused
+ * @return    None
+ */
+static void resume(const char *unused)
+{
+    if (!ctx->yielded)
+    {
+        return;
+    }
+    ctx->yielded = 0;
+    run(NULL);
+    if (!ctx->yielded && ctx->src)
+    {
+        eval(NULL);
+    }
+}
+
+#endif
+
+/**
+ * @brief     Make a context the current one for the duration of a call, and
+ *            catch aborts. Calls nest, also for the same context; an abort
+ *            in a nested call leaves the stacks of the outer one as they were
+ *            when the nested call started
+ * @param     c: Context
+ * @param     fn: Function to call
+ * @param[in] arg: Argument for the function
+ * @return    Result of the call
+ */
+static zf_result ctx_call(zf_ctx *c, void (*fn)(const char *arg), const char *arg)
+{
+    zf_ctx *prev = ctx;
+    jmp_buf *prev_jmpbuf = c->jmpbuf;
+    jmp_buf jmpbuf;
+    zf_result r;
+    zf_addr dsp, rsp;
+
+    ctx = c;
+    dsp = prev_jmpbuf ? DSP : 0;
+    rsp = prev_jmpbuf ? RSP : 0;
+    c->jmpbuf = &jmpbuf;
+    r = (zf_result)setjmp(jmpbuf);
+
+    if (r == ZF_OK)
+    {
+        fn(arg);
+    }
+    else
+    {
+        ctx = c;
+#if ZF_ENABLE_TASKS
+        task_drop(0);
+#endif
+#if ZF_ENABLE_YIELD
+        c->yielded = 0;
+#endif
+        COMPILING = 0;
+        RSP = rsp;
+        DSP = dsp;
+    }
+
+    c->jmpbuf = prev_jmpbuf;
+    ctx = prev;
+    return r;
+}
+
+/**
+ * @brief  Get the size of a context, for allocating one
+ * @param  None
+ * @return Size of a zf_ctx in bytes
+ */
+size_t zf_ctx_size(void)
+{
+    return sizeof(zf_ctx);
+}
+
+/**
+ * @brief     Initialize an interpreter context
+ * @param     c: Context to initialize
+ * @param[in] dict: Dictionary memory, aligned for zf_addr
+ * @param     dict_size: Size of the dictionary in bytes, at most ZF_DICT_SIZE
+ * @param[in] dstack: Data stack memory
+ * @param     dstack_size: Size of the data stack in cells. With
+ *            ZF_ENABLE_TOS_CACHE one cell is kept spare
+ * @param[in] rstack: Return stack memory
+ * @param     rstack_size: Size of the return stack in cells
+ * @param     enable_trace: Enable tracing if set to 1
+ * @return    ZF_OK, or ZF_ABORT_INVALID_SIZE if a size is out of range
+ */
+zf_result zf_ctx_init(zf_ctx *c, void *dict, zf_addr dict_size, zf_cell *dstack, zf_addr dstack_size,
+                      zf_cell *rstack, zf_addr rstack_size, int enable_trace)
+{
+    if (dict_size <= ZF_USERVAR_COUNT * sizeof(zf_addr) || dict_size > ZF_DICT_SIZE ||
+        dstack_size <= ZF_ENABLE_TOS_CACHE || rstack_size == 0)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->dict = dict;
+    c->dict_size = dict_size;
+#if ZF_ENABLE_TOS_CACHE
+    c->dstack_mem = dstack;
+    c->dstack = dstack + 1;
+    c->dstack_size = dstack_size - 1;
+#else
+    c->dstack = dstack;
+    c->dstack_size = dstack_size;
+#endif
+    c->rstack = rstack;
+    c->rstack_size = rstack_size;
+    c->uservar = (zf_addr *)dict;
+#if ZF_ENABLE_ROM
+    c->rom_size = ZF_USERVAR_COUNT * sizeof(zf_addr);
+#endif
+#if ZF_ENABLE_TASKS
+    c->tasks[0].dstack = c->dstack;
+#endif
+
+    c->uservar[ZF_USERVAR_HERE] = ZF_USERVAR_COUNT * sizeof(zf_addr);
+    c->uservar[ZF_USERVAR_TRACE] = enable_trace;
+    c->uservar[ZF_USERVAR_LATEST] = 0;
+    c->uservar[ZF_USERVAR_DSP] = 0;
+    c->uservar[ZF_USERVAR_RSP] = 0;
+    c->uservar[ZF_USERVAR_COMPILING] = 0;
+    zf_ctx_dict_changed(c);
+    return ZF_OK;
+}
+
+/**
+ * @brief  Release the resources held by a context besides its memory
+ * @param  c: Context
+ * @return None
+ */
+void zf_ctx_release(zf_ctx *c)
+{
+#if ZF_ENABLE_JIT
+    zf_ctx *prev = ctx;
+    ctx = c;
+    jit_release();
+    ctx = prev;
+#endif
+}
+
+#if ZF_ENABLE_ROM
+
+/**
+ * @brief     Execute a dictionary image in place from read-only memory, such
+ *            as flash, instead of copying it to the dictionary. New words are
+ *            compiled to RAM after the image, and writes to the image abort
+ * @param     c: Context
+ * @param[in] rom: Dictionary image, as saved from an interpreter with the
+ *            same configuration
+ * @param     rom_size: Size of the image in bytes, at most ZF_ROM_SIZE
+ * @return    ZF_OK, or ZF_ABORT_INVALID_SIZE if the image does not fit
+ */
+zf_result zf_ctx_map_rom(zf_ctx *c, const void *rom, zf_addr rom_size)
+{
+    zf_addr uservar[ZF_USERVAR_COUNT];
+    zf_addr ram_size = c->dict_size - (c->rom_size - sizeof(uservar));
+
+    if (rom_size <= sizeof(uservar) || rom_size > ZF_ROM_SIZE)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+    memcpy(uservar, rom, sizeof(uservar));
+    if (uservar[ZF_USERVAR_HERE] > rom_size)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+
+    c->rom = rom;
+    c->rom_size = rom_size;
+    c->dict_size = rom_size + ram_size - ZF_USERVAR_COUNT * sizeof(zf_addr);
+    c->uservar[ZF_USERVAR_HERE] = rom_size;
+    c->uservar[ZF_USERVAR_LATEST] = uservar[ZF_USERVAR_LATEST];
+    zf_ctx_dict_changed(c);
+    return ZF_OK;
+}
+
+/**
+ * @brief     Execute a dictionary image in place from read-only memory
+ * @param[in] rom: Dictionary image
+ * @param     rom_size: Size of the image in bytes
+ * @return    Result of the operation
+ */
+zf_result zf_map_rom(const void *rom, zf_addr rom_size)
+{
+    return zf_ctx_map_rom(ctx, rom, rom_size);
+}
+
+#endif
+
+#if ZF_ENABLE_TASKS
+
+/**
+ * @brief     Create a task in an interpreter context, which starts running the
+ *            given word at the next 'pause'
+ * @param     c: Context
+ * @param     xt: Execution token of the word to run
+ * @param[in] dstack: Data stack memory
+ * @param     dstack_size: Size of the data stack in cells. With
+ *            ZF_ENABLE_TOS_CACHE one cell is kept spare
+ * @param[in] rstack: Return stack memory
+ * @param     rstack_size: Size of the return stack in cells
+ * @return    ZF_OK, or ZF_ABORT_INVALID_SIZE if a size is out of range or
+ *            ZF_TASKS_MAX tasks are running already
+ */
+zf_result zf_ctx_task_create(zf_ctx *c, zf_addr xt, zf_cell *dstack, zf_addr dstack_size, zf_cell *rstack,
+                             zf_addr rstack_size)
+{
+    zf_addr n;
+    zf_task *t;
+
+    if (dstack_size <= ZF_ENABLE_TOS_CACHE || rstack_size == 0)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+    for (n = 1; n < ZF_TASKS_MAX && c->tasks[n].dstack; n++)
+    {
+    }
+    if (n == ZF_TASKS_MAX)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+
+    t = &c->tasks[n];
+    t->dstack = dstack + ZF_ENABLE_TOS_CACHE;
+    t->dstack_size = dstack_size - ZF_ENABLE_TOS_CACHE;
+    t->rstack = rstack;
+    t->rstack_size = rstack_size;
+    t->dsp = 0;
+    t->rsp = 1;
+    t->ip = xt;
+    rstack[0] = 0;
+    return ZF_OK;
+}
+
+/**
+ * @brief     Create a task, which starts running the given word at the next
+ *            'pause'
+ * @param     xt: Execution token of the word to run
+ * @param[in] dstack: Data stack memory
+ * @param     dstack_size: Size of the data stack in cells
+ * @param[in] rstack: Return stack memory
+ * @param     rstack_size: Size of the return stack in cells
+ * @return    Result of the operation
+ */
+zf_result zf_task_create(zf_addr xt, zf_cell *dstack, zf_addr dstack_size, zf_cell *rstack, zf_addr rstack_size)
+{
+    return zf_ctx_task_create(ctx, xt, dstack, dstack_size, rstack, rstack_size);
+}
+
+#endif
+
+#if ZF_ENABLE_CHANNELS
+
+/**
+ * @brief  Get the size of a channel
+ * @param  capacity: Number of values the channel holds
+ * @return Size in bytes
+ */
+size_t zf_chan_size(zf_addr capacity)
+{
+    return sizeof(zf_chan) + capacity * sizeof(zf_chan_slot);
+}
+
+/**
+ * @brief  Initialize a channel in memory of zf_chan_size() bytes, aligned
+ *         like the memory returned by malloc()
+ * @param  chan: Channel
+ * @param  capacity: Number of values the channel holds, a power of two of at
+ *         least 2
+ * @return ZF_OK, or ZF_ABORT_INVALID_SIZE if the capacity is not supported
+ */
+zf_result zf_chan_init(zf_chan *chan, zf_addr capacity)
+{
+    zf_addr i;
+
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+    for (i = 0; i < capacity; i++)
+    {
+        atomic_init(&chan->slot[i].seq, i);
+    }
+    atomic_init(&chan->head, 0);
+    atomic_init(&chan->tail, 0);
+    chan->mask = capacity - 1;
+    return ZF_OK;
+}
+
+/**
+ * @brief  Send a value to a channel without waiting
+ * @param  chan: Channel
+ * @param  v: Value to send
+ * @return 1 if the value was sent, 0 if the channel is full
+ */
+int zf_chan_send(zf_chan *chan, zf_cell v)
+{
+    size_t pos = atomic_load_explicit(&chan->head, memory_order_relaxed);
+    zf_chan_slot *s;
+    ptrdiff_t diff;
+
+    for (;;)
+    {
+        s = &chan->slot[pos & chan->mask];
+        diff = (ptrdiff_t)(atomic_load_explicit(&s->seq, memory_order_acquire) - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&chan->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&chan->head, memory_order_relaxed);
+        }
+    }
+
+    s->value = v;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * @brief      Receive a value from a channel without waiting
+ * @param      chan: Channel
+ * @param[out] v: Value received
+ * @return     1 if a value was received, 0 if the channel is empty
+ */
+int zf_chan_recv(zf_chan *chan, zf_cell *v)
+{
+    size_t pos = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+    zf_chan_slot *s;
+    ptrdiff_t diff;
+
+    for (;;)
+    {
+        s = &chan->slot[pos & chan->mask];
+        diff = (ptrdiff_t)(atomic_load_explicit(&s->seq, memory_order_acquire) - (pos + 1));
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&chan->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&chan->tail, memory_order_relaxed);
+        }
+    }
+
+    *v = s->value;
+    atomic_store_explicit(&s->seq, pos + chan->mask + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * @brief  Attach a channel to an interpreter context, which makes it
+ *         available to the channel words under the given id
+ * @param  c: Context
+ * @param  id: Channel id, below ZF_CHANNELS_MAX
+ * @param  chan: Channel, or NULL to detach the id
+ * @return ZF_OK, or ZF_ABORT_INVALID_SIZE if the id is out of range
+ */
+zf_result zf_ctx_chan_attach(zf_ctx *c, zf_addr id, zf_chan *chan)
+{
+    if (id >= ZF_CHANNELS_MAX)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+    c->chans[id] = chan;
+    return ZF_OK;
+}
+
+/**
+ * @brief  Attach a channel under the given id
+ * @param  id: Channel id
+ * @param  chan: Channel, or NULL to detach the id
+ * @return Result of the operation
+ */
+zf_result zf_chan_attach(zf_addr id, zf_chan *chan)
+{
+    return zf_ctx_chan_attach(ctx, id, chan);
+}
+
+#endif
+
 /**
- * @brief  Handle one character. Split into words to pass to handle_word(), or pass the
- *         character to a deferred primitive if it requested a character from the input.
- * @param  c: Character to handle
- * @return None
+ * @brief  Get the context the interpreter is running, for use in host
+ *         callbacks
+ * @param  None
+ * @return Current context
  */
-static void handle_char(char c)
+zf_ctx *zf_ctx_current(void)
 {
-    static char buf[32];
-    static size_t len = 0;
-
-    if (input_state == ZF_INPUT_PASS_CHAR)
-    {
-        input_state = ZF_INPUT_INTERPRET;
-        run(&c);
-    }
-    else if (c != '\0' && !isspace(c))
-    {
-        if (len < sizeof(buf) - 1)
-        {
-            buf[len++] = c;
-            buf[len] = '\0';
-        }
-    }
-    else
-    {
-        if (len > 0)
-        {
-            len = 0;
-            handle_word(buf);
-        }
-    }
+    return ctx;
 }
 
 /**
- * @brief  Initialize the forth interpreter
+ * @brief  Initialize the forth interpreter with the default context, and make
+ *         it the current one
  * @param  enable_trace: Enable tracing if set to 1
  * @return None
  * @note   TODO: make enable_trace a bool
  */
 void zf_init(int enable_trace)
 {
-    HERE = ZF_USERVAR_COUNT * sizeof(zf_addr);
-    TRACE = enable_trace;
-    LATEST = 0;
-    DSP = 0;
-    RSP = 0;
-    COMPILING = 0;
+    zf_ctx_init(&default_ctx, default_dict, sizeof(default_dict), default_dstack,
+                sizeof(default_dstack) / sizeof(zf_cell), default_rstack,
+                sizeof(default_rstack) / sizeof(zf_cell), enable_trace);
+    ctx = &default_ctx;
 }
 
 #if ZF_ENABLE_BOOTSTRAP
@@ -1098,18 +3219,19 @@ static void add_uservar(const char *name, zf_addr addr)
     create(name, 0);
     dict_add_lit(addr);
     dict_add_op(PRIM_EXIT);
+#if ZF_ENABLE_VERIFY
+    verify(word_xt(LATEST), HERE);
+#endif
 }
 
 /**
- * @brief  Bootstrap the forth interpreter by adding primitives and user variables
- * @param  None
- * @return None
+ * @brief     Add primitives and user variables to the dictionary of the
+ *            current context
+ * @param[in] unused: Unused
+ * @return    None
  */
-void zf_bootstrap(void)
+static void bootstrap(const char *unused)
 {
-
-    /* Add primitives and user variables to dictionary */
-
     zf_addr i = 0;
     const char *p;
     for (p = prim_names; *p; p += strlen(p) + 1)
@@ -1124,39 +3246,326 @@ void zf_bootstrap(void)
     }
 }
 
+/**
+ * @brief  Bootstrap an interpreter context by adding primitives and user
+ *         variables
+ * @param  c: Context
+ * @return Result of the bootstrap, an abort if the dictionary is too small
+ */
+zf_result zf_ctx_bootstrap(zf_ctx *c)
+{
+    return ctx_call(c, bootstrap, NULL);
+}
+
 #else
-void zf_bootstrap(void) {}
+zf_result zf_ctx_bootstrap(zf_ctx *c)
+{
+    return ZF_OK;
+}
+#endif
+
+/**
+ * @brief  Bootstrap the forth interpreter by adding primitives and user variables
+ * @param  None
+ * @return None
+ */
+void zf_bootstrap(void)
+{
+    zf_ctx_bootstrap(ctx);
+}
+
+/**
+ * @brief     Start evaluating input in an interpreter context
+ * @param     c: Context
+ * @param[in] buf: Input to evaluate
+ * @param     len: Length of the input
+ * @return    Result of the evaluation
+ */
+static zf_result ctx_eval(zf_ctx *c, const char *buf, size_t len)
+{
+    zf_result r;
+    size_t pos = c->src_pos;
+
+#if ZF_ENABLE_TASKS
+    /* Input for a primitive waiting in a parked task goes to that task, any
+     * other evaluation starts over on task 0 */
+
+    if (c->input_state != ZF_INPUT_INTERPRET)
+    {
+        task_unpark(c);
+    }
+    else if (!c->jmpbuf)
+    {
+        c->task_parked = 0;
+    }
+#endif
+    c->src = buf;
+    c->src_len = len;
+    c->src_base = buf;
+    c->src_pos = 0;
+#if ZF_ENABLE_YIELD
+    c->yielded = 0;
+#endif
+    r = ctx_call(c, eval, NULL);
+#if ZF_ENABLE_TASKS
+    task_park(c);
+#endif
+
+    /* A nested evaluation, from a syscall, leaves the position of the outer
+     * one alone */
+
+    c->eval_pos = c->src_pos;
+    if (c->jmpbuf)
+    {
+        c->src_pos = pos;
+    }
+#if ZF_ENABLE_YIELD
+    if (r == ZF_OK && c->yielded)
+    {
+        r = ZF_YIELD;
+    }
+#endif
+    return r;
+}
+
+/**
+ * @brief     Evaluate a null-terminated string in an interpreter context
+ * @param     c: Context
+ * @param[in] buf: String to evaluate
+ * @return    Result of the evaluation
+ */
+zf_result zf_ctx_eval(zf_ctx *c, const char *buf)
+{
+    return zf_ctx_eval_n(c, buf, strlen(buf));
+}
+
+/**
+ * @brief     Evaluate a string of the given length in an interpreter
+ *            context. The string does not need to be null-terminated
+ * @param     c: Context
+ * @param[in] buf: String to evaluate
+ * @param     len: Length of the string
+ * @return    Result of the evaluation
+ */
+zf_result zf_ctx_eval_n(zf_ctx *c, const char *buf, size_t len)
+{
+#if ZF_ENABLE_YIELD
+    c->steps = 0;
 #endif
+    return ctx_eval(c, buf, len);
+}
+
+/**
+ * @brief  Get the position of the last evaluation in an interpreter context.
+ *         After an abort this is the offset of the word which aborted
+ * @param  c: Context
+ * @return Offset in the input of the word being evaluated, or the length of
+ *         the input if the evaluation ran to its end
+ */
+size_t zf_ctx_eval_pos(zf_ctx *c)
+{
+    return c->eval_pos;
+}
 
 /**
  * @brief     Evaluate a null-terminated string
  * @param[in] buf: String to evaluate
  * @return    Result of the evaluation
- * @note      TODO: save parsed offset for tracing
  */
 zf_result zf_eval(const char *buf)
 {
-    zf_result r = (zf_result)setjmp(jmpbuf);
+    return zf_ctx_eval(ctx, buf);
+}
 
-    if (r == ZF_OK)
+/**
+ * @brief     Evaluate a string of the given length
+ * @param[in] buf: String to evaluate
+ * @param     len: Length of the string
+ * @return    Result of the evaluation
+ */
+zf_result zf_eval_n(const char *buf, size_t len)
+{
+    return zf_ctx_eval_n(ctx, buf, len);
+}
+
+/**
+ * @brief  Get the position of the last evaluation
+ * @param  None
+ * @return Offset in the input of the word being evaluated
+ */
+size_t zf_eval_pos(void)
+{
+    return zf_ctx_eval_pos(ctx);
+}
+
+/**
+ * @brief  Execute a word in an interpreter context, with the values on its
+ *         data stack
+ * @param  c: Context
+ * @param  xt: Execution token of the word
+ * @return Result of the execution
+ */
+zf_result zf_ctx_execute(zf_ctx *c, zf_addr xt)
+{
+    zf_result r;
+
+#if ZF_ENABLE_YIELD
+    c->steps = 0;
+    c->yielded = 0;
+    c->src = NULL;
+#endif
+#if ZF_ENABLE_TASKS
+    if (!c->jmpbuf)
     {
-        for (;;)
+        c->task_parked = 0;
+    }
+#endif
+    r = ctx_call(c, execute_xt, (const char *)&xt);
+#if ZF_ENABLE_TASKS
+    task_park(c);
+#endif
+#if ZF_ENABLE_YIELD
+    if (r == ZF_OK && c->yielded)
+    {
+        r = ZF_YIELD;
+    }
+#endif
+    return r;
+}
+
+/**
+ * @brief  Execute a word
+ * @param  xt: Execution token of the word
+ * @return Result of the execution
+ */
+zf_result zf_execute(zf_addr xt)
+{
+    return zf_ctx_execute(ctx, xt);
+}
+
+#if ZF_ENABLE_YIELD
+
+/**
+ * @brief     Evaluate a null-terminated string in an interpreter context, or
+ *            resume the evaluation which yielded last, running at most the
+ *            given number of instructions. The string must stay valid until
+ *            the evaluation is finished
+ * @param     c: Context
+ * @param[in] buf: String to evaluate, or NULL to resume
+ * @param     steps: Maximum number of instructions to run, 0 for no limit
+ * @return    Result of the evaluation, or ZF_YIELD if it ran out of
+ *            instructions or zf_yield() was called
+ */
+zf_result zf_ctx_run_steps(zf_ctx *c, const char *buf, uint32_t steps)
+{
+    zf_result r;
+
+    c->steps = steps ? steps + 1 : 0;
+    if (buf)
+    {
+        r = ctx_eval(c, buf, strlen(buf));
+    }
+    else
+    {
+#if ZF_ENABLE_TASKS
+        task_unpark(c);
+#endif
+        r = ctx_call(c, resume, NULL);
+#if ZF_ENABLE_TASKS
+        task_park(c);
+#endif
+        c->eval_pos = c->src_pos;
+    }
+    c->steps = 0;
+    return (r == ZF_OK && c->yielded) ? ZF_YIELD : r;
+}
+
+/**
+ * @brief     Evaluate a null-terminated string, or resume the evaluation
+ *            which yielded last, running at most the given number of
+ *            instructions
+ * @param[in] buf: String to evaluate, or NULL to resume
+ * @param     steps: Maximum number of instructions to run, 0 for no limit
+ * @return    Result of the evaluation
+ */
+zf_result zf_run_steps(const char *buf, uint32_t steps)
+{
+    return zf_ctx_run_steps(ctx, buf, steps);
+}
+
+/**
+ * @brief     Complete a suspended syscall of an interpreter context: push its
+ *            results and resume the evaluation
+ * @param     c: Context
+ * @param[in] results: Values to push on the data stack
+ * @param     count: Number of values
+ * @return    Result of the evaluation
+ */
+zf_result zf_ctx_resume(zf_ctx *c, const zf_cell *results, zf_addr count)
+{
+    zf_result r;
+    zf_addr i;
+
+#if ZF_ENABLE_TASKS
+    /* The results go to the task which suspended */
+    task_unpark(c);
+#endif
+    for (i = 0; i < count; i++)
+    {
+        r = zf_ctx_push(c, results[i]);
+        if (r != ZF_OK)
         {
-            handle_char(*buf);
-            if (*buf == '\0')
-            {
-                return ZF_OK;
-            }
-            buf++;
+#if ZF_ENABLE_TASKS
+            task_park(c);
+#endif
+            return r;
         }
     }
-    else
+    return zf_ctx_run_steps(c, NULL, 0);
+}
+
+/**
+ * @brief     Complete a suspended syscall: push its results and resume the
+ *            evaluation
+ * @param[in] results: Values to push on the data stack
+ * @param     count: Number of values
+ * @return    Result of the evaluation
+ */
+zf_result zf_resume(const zf_cell *results, zf_addr count)
+{
+    return zf_ctx_resume(ctx, results, count);
+}
+
+/**
+ * @brief  Make the running evaluation of the current context yield before
+ *         its next instruction, e.g. from a syscall which finds that the
+ *         time slice of the script is over
+ * @param  None
+ * @return None
+ */
+void zf_yield(void)
+{
+    ctx->steps = 1;
+}
+
+#endif
+
+/**
+ * @brief      Get dictionary dump of an interpreter context
+ * @param      c: Context
+ * @param[out] len: Length of the dictionary
+ * @return     Pointer to the dictionary
+ */
+void *zf_ctx_dump(zf_ctx *c, size_t *len)
+{
+    if (len)
     {
-        COMPILING = 0;
-        RSP = 0;
-        DSP = 0;
-        return r;
+        *len = c->dict_size;
+#if ZF_ENABLE_ROM
+        *len -= c->rom_size - ZF_USERVAR_COUNT * sizeof(zf_addr);
+#endif
     }
+    return c->dict;
 }
 
 /**
@@ -1166,26 +3575,124 @@ zf_result zf_eval(const char *buf)
  */
 void *zf_dump(size_t *len)
 {
-    if (len)
+    return zf_ctx_dump(ctx, len);
+}
+
+/**
+ * @brief     Rebuild the tables kept for the dictionary of the current context
+ * @param[in] unused: Unused
+ * @return    None
+ */
+static void dict_changed(const char *unused)
+{
+#if ZF_ENABLE_INLINE
+    memset(ctx->inline_always, 0, sizeof(ctx->inline_always));
+    memset(ctx->inline_never, 0, sizeof(ctx->inline_never));
+#endif
+#if ZF_ENABLE_DECODE_CACHE
+    memset(ctx->decode_cache, 0, sizeof(ctx->decode_cache));
+#endif
+#if ZF_ENABLE_WORD_HASH
+    ctx->word_hash_latest = (zf_addr)-1;
+    word_hash_sync();
+#endif
+#if ZF_ENABLE_VERIFY
+    verify_all();
+#endif
+}
+
+/**
+ * @brief  Notify an interpreter context that its dictionary was modified
+ *         through the pointer returned by zf_ctx_dump(), for example after
+ *         loading an image
+ * @param  c: Context
+ * @return None
+ */
+void zf_ctx_dict_changed(zf_ctx *c)
+{
+    ctx_call(c, dict_changed, NULL);
+}
+
+/**
+ * @brief  Notify the interpreter that the dictionary was modified through the
+ *         pointer returned by zf_dump(), for example after loading an image
+ * @param  None
+ * @return None
+ */
+void zf_dict_changed(void)
+{
+    zf_ctx_dict_changed(ctx);
+}
+
+/**
+ * @brief  Push a value to the data stack of an interpreter context
+ * @param  c: Context
+ * @param  v: Value to push
+ * @return Result of the operation
+ */
+zf_result zf_ctx_push(zf_ctx *c, zf_cell v)
+{
+    zf_addr *dsp = &c->uservar[ZF_USERVAR_DSP];
+
+    if (*dsp >= c->dstack_size)
     {
-        *len = sizeof(dict);
+        return ZF_ABORT_DSTACK_OVERRUN;
     }
-    return dict;
+    c->dstack[(*dsp)++] = v;
+    return ZF_OK;
 }
 
 /**
- * @brief  Set a user variable
+ * @brief      Pop a value from the data stack of an interpreter context
+ * @param      c: Context
+ * @param[out] v: Value destination
+ * @return     Result of the operation
+ */
+zf_result zf_ctx_pop(zf_ctx *c, zf_cell *v)
+{
+    zf_addr *dsp = &c->uservar[ZF_USERVAR_DSP];
+
+    if (*dsp == 0)
+    {
+        return ZF_ABORT_DSTACK_UNDERRUN;
+    }
+    *v = c->dstack[--(*dsp)];
+    return ZF_OK;
+}
+
+/**
+ * @brief      Pick a value from the data stack of an interpreter context
+ * @param      c: Context
+ * @param      n: Index of the value to pick (0 = top of stack)
+ * @param[out] v: Value destination
+ * @return     Result of the operation
+ */
+zf_result zf_ctx_pick(zf_ctx *c, zf_addr n, zf_cell *v)
+{
+    zf_addr dsp = c->uservar[ZF_USERVAR_DSP];
+
+    if (n >= dsp)
+    {
+        return ZF_ABORT_DSTACK_UNDERRUN;
+    }
+    *v = c->dstack[dsp - n - 1];
+    return ZF_OK;
+}
+
+/**
+ * @brief  Set a user variable of an interpreter context
+ * @param  c: Context
  * @param  uv: User variable ID
  * @param  v: Value to set
  * @return Result of the operation
  */
-zf_result zf_uservar_set(zf_uservar_id uv, zf_cell v)
+zf_result zf_ctx_uservar_set(zf_ctx *c, zf_uservar_id uv, zf_cell v)
 {
     zf_result result = ZF_ABORT_INVALID_USERVAR;
 
     if (uv < ZF_USERVAR_COUNT)
     {
-        uservar[uv] = v;
+        c->uservar[uv] = v;
         result = ZF_OK;
     }
 
@@ -1193,12 +3700,24 @@ zf_result zf_uservar_set(zf_uservar_id uv, zf_cell v)
 }
 
 /**
- * @brief      Get a user variable
+ * @brief  Set a user variable
+ * @param  uv: User variable ID
+ * @param  v: Value to set
+ * @return Result of the operation
+ */
+zf_result zf_uservar_set(zf_uservar_id uv, zf_cell v)
+{
+    return zf_ctx_uservar_set(ctx, uv, v);
+}
+
+/**
+ * @brief      Get a user variable of an interpreter context
+ * @param      c: Context
  * @param      uv: User variable ID
  * @param[out] v: Value destination
  * @return     Result of the operation
  */
-zf_result zf_uservar_get(zf_uservar_id uv, zf_cell *v)
+zf_result zf_ctx_uservar_get(zf_ctx *c, zf_uservar_id uv, zf_cell *v)
 {
     zf_result result = ZF_ABORT_INVALID_USERVAR;
 
@@ -1206,10 +3725,33 @@ zf_result zf_uservar_get(zf_uservar_id uv, zf_cell *v)
     {
         if (v != NULL)
         {
-            *v = uservar[uv];
+            *v = c->uservar[uv];
         }
         result = ZF_OK;
     }
 
     return result;
 }
+
+/**
+ * @brief      Get a user variable
+ * @param      uv: User variable ID
+ * @param[out] v: Value destination
+ * @return     Result of the operation
+ */
+zf_result zf_uservar_get(zf_uservar_id uv, zf_cell *v)
+{
+    return zf_ctx_uservar_get(ctx, uv, v);
+}
+
+#if ZF_ENABLE_BATCH
+#include "zforth_batch.h"
+#endif
+
+#if ZF_ENABLE_SNAPSHOT
+#include "zforth_snapshot.h"
+#endif
+
+#if ZF_ENABLE_PARALLEL
+#include "zforth_parallel.h"
+#endif
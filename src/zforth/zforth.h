@@ -11,7 +11,7 @@ extern "C" {
 
 #include <zfconf.h>
 
-/* Abort reasons */
+/* Results. All but ZF_OK and ZF_YIELD are abort reasons */
 
 typedef enum
 {
@@ -27,14 +27,16 @@ typedef enum
     ZF_ABORT_INVALID_SIZE,
     ZF_ABORT_DIVISION_BY_ZERO,
     ZF_ABORT_INVALID_USERVAR,
-    ZF_ABORT_EXTERNAL
+    ZF_ABORT_EXTERNAL,
+    ZF_YIELD
 } zf_result;
 
 typedef enum
 {
     ZF_INPUT_INTERPRET,
     ZF_INPUT_PASS_CHAR,
-    ZF_INPUT_PASS_WORD
+    ZF_INPUT_PASS_WORD,
+    ZF_INPUT_SUSPEND
 } zf_input_state;
 
 typedef enum
@@ -58,12 +60,49 @@ typedef enum
     ZF_USERVAR_COUNT
 } zf_uservar_id;
 
-/* ZForth API functions */
+/* Interpreter context. Every interpreter instance keeps all of its state in
+ * a zf_ctx, which is allocated by the caller with zf_ctx_size() bytes, and
+ * works on dictionary and stack memory provided by the caller. While a
+ * zf_ctx_*() function runs, its context is the current one, which the
+ * functions without a context argument work on; this makes zf_push() and
+ * friends work from within the host callbacks. A context must not be used by
+ * more than one thread at a time; different contexts can run on different
+ * threads if ZF_THREAD_LOCAL is set in zfconf.h */
+
+typedef struct zf_ctx zf_ctx;
+
+size_t zf_ctx_size(void);
+zf_result zf_ctx_init(zf_ctx *ctx, void *dict, zf_addr dict_size, zf_cell *dstack, zf_addr dstack_size,
+                      zf_cell *rstack, zf_addr rstack_size, int trace);
+void zf_ctx_release(zf_ctx *ctx);
+zf_ctx *zf_ctx_current(void);
+zf_result zf_ctx_bootstrap(zf_ctx *ctx);
+void *zf_ctx_dump(zf_ctx *ctx, size_t *len);
+void zf_ctx_dict_changed(zf_ctx *ctx);
+zf_result zf_ctx_eval(zf_ctx *ctx, const char *buf);
+zf_result zf_ctx_eval_n(zf_ctx *ctx, const char *buf, size_t len);
+size_t zf_ctx_eval_pos(zf_ctx *ctx);
+zf_result zf_ctx_execute(zf_ctx *ctx, zf_addr xt);
+
+zf_result zf_ctx_push(zf_ctx *ctx, zf_cell v);
+zf_result zf_ctx_pop(zf_ctx *ctx, zf_cell *v);
+zf_result zf_ctx_pick(zf_ctx *ctx, zf_addr n, zf_cell *v);
+
+zf_result zf_ctx_uservar_set(zf_ctx *ctx, zf_uservar_id uv, zf_cell v);
+zf_result zf_ctx_uservar_get(zf_ctx *ctx, zf_uservar_id uv, zf_cell *v);
+
+/* ZForth API functions, working on the current context. zf_init() sets up the
+ * default context with ZF_DICT_SIZE, ZF_DSTACK_SIZE and ZF_RSTACK_SIZE and
+ * makes it the current one */
 
 void zf_init(int trace);
 void zf_bootstrap(void);
 void *zf_dump(size_t *len);
+void zf_dict_changed(void);
 zf_result zf_eval(const char *buf);
+zf_result zf_eval_n(const char *buf, size_t len);
+size_t zf_eval_pos(void);
+zf_result zf_execute(zf_addr xt);
 void zf_abort(zf_result reason);
 
 void zf_push(zf_cell v);
@@ -73,6 +112,160 @@ zf_cell zf_pick(zf_addr n);
 zf_result zf_uservar_set(zf_uservar_id uv, zf_cell v);
 zf_result zf_uservar_get(zf_uservar_id uv, zf_cell *v);
 
+#if ZF_ENABLE_ROM
+
+/* Dictionary images executed in place from read-only memory. The image takes
+ * the low addresses of the dictionary, the RAM given to zf_ctx_init() holds
+ * the user variables and the words defined after the image. zf_dump() only
+ * returns the RAM part then */
+
+zf_result zf_ctx_map_rom(zf_ctx *ctx, const void *rom, zf_addr rom_size);
+zf_result zf_map_rom(const void *rom, zf_addr rom_size);
+
+#endif
+
+#if ZF_ENABLE_TASKS
+
+/* Cooperative tasks. A task runs the word with the given execution token on
+ * stacks provided by the caller, taking turns with the other tasks of its
+ * context whenever one of them executes 'pause'. Task 0 runs the words passed
+ * to zf_eval(), so the host runs the other tasks by evaluating 'pause'. The
+ * host API always works on the stacks of task 0: when another task yields or
+ * suspends, the context switches back to task 0 on the way out, and resuming
+ * the evaluation continues the task that stopped */
+
+zf_result zf_ctx_task_create(zf_ctx *ctx, zf_addr xt, zf_cell *dstack, zf_addr dstack_size, zf_cell *rstack,
+                             zf_addr rstack_size);
+zf_result zf_task_create(zf_addr xt, zf_cell *dstack, zf_addr dstack_size, zf_cell *rstack, zf_addr rstack_size);
+
+#endif
+
+#if ZF_ENABLE_YIELD
+
+/* Evaluation with an instruction budget. zf_run_steps() returns ZF_YIELD when
+ * the budget runs out, or when a host callback called zf_yield(), and keeps
+ * the state of the interpreter; calling it again with buf set to NULL resumes
+ * the evaluation where it stopped. Words compiled to native code are not run
+ * natively while there is a budget, words translated by z4c count as one
+ * instruction.
+ *
+ * A syscall which can not complete right away returns ZF_INPUT_SUSPEND from
+ * zf_host_sys(), which makes the evaluation return ZF_YIELD as well. Once the
+ * result is available the host pushes it with zf_resume(), which continues
+ * the evaluation after the syscall */
+
+zf_result zf_ctx_run_steps(zf_ctx *ctx, const char *buf, uint32_t steps);
+zf_result zf_ctx_resume(zf_ctx *ctx, const zf_cell *results, zf_addr count);
+zf_result zf_run_steps(const char *buf, uint32_t steps);
+zf_result zf_resume(const zf_cell *results, zf_addr count);
+void zf_yield(void);
+
+#endif
+
+#if ZF_ENABLE_BATCH
+
+/* Batch evaluation. zf_eval_batch() runs a job for every record on a pool of
+ * threads, one for each of the given contexts, which should all hold the
+ * words the jobs use. A job starts with empty stacks and the input values
+ * pushed, bottom first, evaluates its source or executes its word, and
+ * collects up to out_size values from the top of the data stack, bottom
+ * first. Words defined by a job are dropped when it ends, and a job which
+ * leaves a definition open fails with ZF_ABORT_COMPILE_ONLY_WORD. Values
+ * stored in the dictionary are kept, so jobs should not write to variables
+ * they share with other jobs. Jobs are divided evenly between the threads up front, and a thread
+ * which runs out of jobs steals half of the jobs left to the busiest one */
+
+typedef struct
+{
+    const char *src;   /* Source to evaluate, or NULL to execute xt */
+    zf_addr xt;        /* Execution token of the word to execute */
+    const zf_cell *in; /* Values to push before running the job */
+    zf_addr in_count;  /* Number of values in 'in' */
+    zf_cell *out;      /* Destination for the data stack after the job */
+    zf_addr out_size;  /* Room in 'out' */
+    zf_addr out_count; /* Number of values stored in 'out' */
+    zf_result result;  /* Result of the job */
+} zf_job;
+
+zf_result zf_eval_batch(zf_ctx **ctxs, size_t ctx_count, zf_job *jobs, size_t job_count);
+
+#endif
+
+#if ZF_ENABLE_CHANNELS
+
+/* Channels between contexts. A channel is a bounded lock-free queue of cells
+ * in memory provided by the host, which any number of contexts and threads
+ * can send to and receive from. The host attaches a channel to every context
+ * using it, under an id of its choice, and Forth code passes that id to
+ * 'chan-send', 'chan-recv' and 'chan-try-recv'. A send to a full channel or a
+ * receive from an empty one switches to the next task; when all tasks are
+ * waiting, the evaluation returns ZF_YIELD, and the host resumes it with
+ * zf_run_steps() after running the other side */
+
+typedef struct zf_chan zf_chan;
+
+size_t zf_chan_size(zf_addr capacity);
+zf_result zf_chan_init(zf_chan *chan, zf_addr capacity);
+int zf_chan_send(zf_chan *chan, zf_cell v);
+int zf_chan_recv(zf_chan *chan, zf_cell *v);
+zf_result zf_ctx_chan_attach(zf_ctx *ctx, zf_addr id, zf_chan *chan);
+zf_result zf_chan_attach(zf_addr id, zf_chan *chan);
+
+#endif
+
+#if ZF_ENABLE_SNAPSHOT
+
+/* Snapshots of contexts. zf_ctx_snapshot() saves the complete state of a
+ * context between evaluations, and zf_fork() creates any number of new
+ * contexts from it, which start where the snapshot was taken. Forks share
+ * the memory of the snapshot copy-on-write, so a fork only costs the pages
+ * it writes to, and allocate it themselves: release them with
+ * zf_fork_release(), not zf_ctx_release() */
+
+typedef struct zf_snapshot zf_snapshot;
+
+zf_snapshot *zf_ctx_snapshot(zf_ctx *ctx);
+zf_snapshot *zf_snapshot_take(void);
+void zf_snapshot_release(zf_snapshot *snapshot);
+zf_ctx *zf_fork(const zf_snapshot *snapshot);
+void zf_fork_release(zf_ctx *ctx);
+
+#endif
+
+#if ZF_ENABLE_PARALLEL
+
+/* Parallel map and reduce. zf_pmap() replaces every element of an array in
+ * the dictionary by the result of a word ( x -- y ), zf_preduce() folds the
+ * elements with an associative word ( x y -- z ). The array is split between
+ * the given number of threads, each running its part in a fork of the
+ * context; side effects of the word besides its result are not kept.
+ * Elements of sizeof(zf_cell) bytes are cells; elements of 1, 2 and 4 bytes
+ * are read as u8, s16 and s32 */
+
+zf_result zf_ctx_pmap(zf_ctx *ctx, zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads);
+zf_result zf_ctx_preduce(zf_ctx *ctx, zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads,
+                         zf_cell *result);
+zf_result zf_pmap(zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads);
+zf_result zf_preduce(zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads, zf_cell *result);
+
+#endif
+
+#if ZF_ENABLE_AOT
+
+/* Words translated to C ahead of time. zf_aot_translate() is only available
+ * with ZF_ENABLE_VERIFY and generates the C code, which defines the
+ * zf_aot_words[] table called by the '(aot)' primitive */
+
+typedef void (*zf_aot_word)(void);
+
+extern const zf_aot_word zf_aot_words[];
+extern const zf_addr zf_aot_count;
+
+zf_addr zf_aot_translate(zf_addr start, int (*select)(const char *name, size_t len),
+                         void (*out)(const char *fmt, ...));
+
+#endif
+
 /* Host provides these functions */
 
 zf_input_state zf_host_sys(zf_syscall_id id, const char *last_word);
@@ -0,0 +1,586 @@
+/* Ahead of time translation of words to C. This file is included by zforth.c
+ * when both ZF_ENABLE_AOT and ZF_ENABLE_VERIFY are set, which is the case for
+ * the z4c cross compiler. The generated C code is built into the target
+ * together with zforth.c, and the code of every translated word in the
+ * dictionary image is replaced by '(aot) <n> exit', which calls the n-th
+ * function in zf_aot_words[].
+ *
+ * Translation builds on verify(), which knows the depth of both stacks at
+ * every instruction of a verified word. Every stack cell a word touches
+ * becomes an element of a local array indexed by constants only, which the C
+ * compiler is free to keep in registers:
+ *
+ *   d[]  data stack, d[0] is the deepest cell taken from the caller
+ *   r[]  return stack cells pushed by the word itself
+ *
+ * Calls between translated words pass a pointer into the data stack array of
+ * the caller and are usually inlined by the C compiler. Only the functions in
+ * zf_aot_words[] touch the real stacks, to take the arguments of the word and
+ * push its results, so the stacks are only checked at that point. Words are
+ * translated if they are verified, only call translated words and do not
+ * access the dictionary. */
+
+#define AOT_TEST(map, a) ((map)[(a) / 8] & (1 << ((a) % 8)))
+#define AOT_SET(map, a)  ((map)[(a) / 8] |= 1 << ((a) % 8))
+
+/* Words which can be translated, words a function is emitted for, and words
+ * which get an entry in zf_aot_words[], by execution token */
+
+static ZF_THREAD_LOCAL uint8_t aot_ok[ZF_ADDR_SPACE / 8];
+static ZF_THREAD_LOCAL uint8_t aot_need[ZF_ADDR_SPACE / 8];
+static ZF_THREAD_LOCAL uint8_t aot_entry[ZF_ADDR_SPACE / 8];
+
+/* Branch targets in the code of the word being translated, and whether it
+ * branches backwards */
+
+static ZF_THREAD_LOCAL uint8_t aot_target[ZF_VERIFY_CODE_MAX];
+static ZF_THREAD_LOCAL int aot_loop;
+
+/**
+ * @brief      Find a word by its position in the dictionary
+ * @param      n: Number of words to skip, starting from the latest one
+ * @param[out] end: End of the code of the word
+ * @return     Address of the word, 0 if there are fewer words
+ */
+static zf_addr aot_word(zf_addr n, zf_addr *end)
+{
+    zf_addr w = LATEST;
+
+    *end = HERE;
+    while (w && n--)
+    {
+        zf_cell d, link;
+        dict_get_cell(w + dict_get_cell(w, &d), &link);
+        *end = w;
+        w = link;
+    }
+    return w;
+}
+
+/**
+ * @brief  Get the number of bytes a cell takes in the dictionary
+ * @param  v: Value of the cell
+ * @return Size of the variable length encoding of the value
+ */
+static zf_addr aot_cell_size(zf_addr v)
+{
+    return v < 128 ? 1 : v < 16384 ? 2 : 1 + sizeof(zf_cell);
+}
+
+/**
+ * @brief  Check if a word can be translated. The stack depths of the word
+ *         are left in verify_state[] and its branch targets in aot_target[]
+ * @param  xt: Execution token of the word
+ * @param  end: End of the code of the word
+ * @return Verification record of the word, NULL if it can not be translated
+ */
+static zf_verified *aot_check(zf_addr xt, zf_addr end)
+{
+    zf_verified *v = verify_find(xt);
+    zf_addr a, b, op, len;
+    zf_cell operand, lit = -1;
+
+    if (v == NULL || !verify(xt, end))
+    {
+        return NULL;
+    }
+
+    memset(aot_target, 0, sizeof(aot_target));
+    aot_loop = 0;
+
+    for (a = xt; a < end;)
+    {
+        int r = verify_state[a - xt].r;
+
+        if (!verify_state[a - xt].seen)
+        {
+            a++;
+            continue;
+        }
+        len = scan_decode(a, &op, &operand);
+        for (b = a + 1; b < a + len && b < end; b++)
+        {
+            if (verify_state[b - xt].seen)
+            {
+                return NULL;
+            }
+        }
+        if (op >= PRIM_COUNT)
+        {
+            if (!AOT_TEST(aot_ok, op))
+            {
+                return NULL;
+            }
+            lit = -1;
+            a += len;
+            continue;
+        }
+        switch (op)
+        {
+        case PRIM_PEEK:
+        case PRIM_POKE:
+        case PRIM_COMMA:
+        case PRIM_LEN:
+            return NULL;
+        case PRIM_LIT:
+            if (operand - operand != 0)
+            {
+                return NULL;
+            }
+            break;
+        case PRIM_JMP:
+        case PRIM_JMP0:
+        case PRIM_LOOP:
+        case PRIM_LOOPP:
+#if ZF_ENABLE_FUSION
+        case PRIM_EQ_JMP0:
+        case PRIM_LTZ_JMP0:
+#endif
+            if ((zf_addr)operand < xt || (zf_addr)operand >= end)
+            {
+                return NULL;
+            }
+            aot_target[(zf_addr)operand - xt] = 1;
+            aot_loop |= (zf_addr)operand <= a;
+            break;
+        case PRIM_PICKR:
+            /* verify() made sure the literal before is the argument */
+            if (lit >= r)
+            {
+                return NULL;
+            }
+            break;
+#if ZF_ENABLE_FUSION
+        case PRIM_LIT_PICKR:
+            if (operand >= r)
+            {
+                return NULL;
+            }
+            break;
+#endif
+        default:
+            break;
+        }
+        lit = operand;
+        a += len;
+    }
+
+    return v;
+}
+
+/**
+ * @brief  Emit the name of a word as a C comment
+ * @param  w: Address of the word
+ * @param  out: Output function
+ * @return None
+ */
+static void aot_name(zf_addr w, void (*out)(const char *fmt, ...))
+{
+    char name[32];
+    zf_cell d, link;
+    int i, len;
+
+    w += dict_get_cell(w, &d);
+    w += dict_get_cell(w, &link);
+    len = ZF_FLAG_LEN((int)d);
+    for (i = 0; i < len; i++)
+    {
+        name[i] = *DICT_MEM(w + i);
+        if (name[i] < ' ' || name[i] > '~' || (name[i] == '/' && i > 0 && name[i - 1] == '*'))
+        {
+            name[i] = '_';
+        }
+    }
+    name[len] = '\0';
+    out("/* %s */\n", name);
+}
+
+/**
+ * @brief  Emit a cell value as a C constant
+ * @param  v: Value
+ * @param  out: Output function
+ * @return None
+ */
+static void aot_const(zf_cell v, void (*out)(const char *fmt, ...))
+{
+    if ((zf_cell)0.5 != 0)
+    {
+        out("(zf_cell)%.17g", (double)v);
+    }
+    else
+    {
+        out("(zf_cell)" ZF_CELL_FMT, v);
+    }
+}
+
+/**
+ * @brief  Emit the C code of one instruction
+ * @param  op: Primitive or address of the called word
+ * @param  operand: Inline operand of the instruction
+ * @param  lit: Operand of the literal before the instruction
+ * @param  next: Address of the next instruction
+ * @param  k: Number of data stack cells in use before the instruction
+ * @param  j: Number of return stack cells in use before the instruction
+ * @param  out: Output function
+ * @return None
+ */
+static void aot_instruction(zf_addr op, zf_cell operand, zf_cell lit, zf_addr next, int k, int j,
+                            void (*out)(const char *fmt, ...))
+{
+    const char *binop = NULL;
+    int n = operand;
+
+    if (op >= PRIM_COUNT)
+    {
+        zf_verified *c = verify_find(op);
+        out("    aot_w%04x(d + %d);\n", op, k - c->need);
+        return;
+    }
+
+    switch (op)
+    {
+    case PRIM_LIT:
+        out("    d[%d] = ", k);
+        aot_const(operand, out);
+        out(";\n");
+        break;
+    case PRIM_LTZ:
+        out("    d[%d] = d[%d] < 0;\n", k - 1, k - 1);
+        break;
+    case PRIM_ADD:
+        binop = "d[%d] = d[%d] + d[%d];\n";
+        break;
+    case PRIM_SUB:
+        binop = "d[%d] = d[%d] - d[%d];\n";
+        break;
+    case PRIM_MUL:
+        binop = "d[%d] = d[%d] * d[%d];\n";
+        break;
+    case PRIM_DIV:
+        out("    if (d[%d] == 0)\n        zf_abort(ZF_ABORT_DIVISION_BY_ZERO);\n", k - 1);
+        binop = "d[%d] = d[%d] / d[%d];\n";
+        break;
+    case PRIM_MOD:
+        out("    if ((int)d[%d] == 0)\n        zf_abort(ZF_ABORT_DIVISION_BY_ZERO);\n", k - 1);
+        binop = "d[%d] = (int)d[%d] %% (int)d[%d];\n";
+        break;
+    case PRIM_EQUAL:
+        binop = "d[%d] = d[%d] == d[%d];\n";
+        break;
+    case PRIM_AND:
+        binop = "d[%d] = (zf_int)d[%d] & (zf_int)d[%d];\n";
+        break;
+    case PRIM_OR:
+        binop = "d[%d] = (zf_int)d[%d] | (zf_int)d[%d];\n";
+        break;
+    case PRIM_XOR:
+        binop = "d[%d] = (zf_int)d[%d] ^ (zf_int)d[%d];\n";
+        break;
+    case PRIM_SHL:
+        binop = "d[%d] = (zf_int)d[%d] << (zf_int)d[%d];\n";
+        break;
+    case PRIM_SHR:
+        binop = "d[%d] = (zf_int)d[%d] >> (zf_int)d[%d];\n";
+        break;
+    case PRIM_DUP:
+        out("    d[%d] = d[%d];\n", k, k - 1);
+        break;
+    case PRIM_SWAP:
+        out("    t = d[%d];\n    d[%d] = d[%d];\n    d[%d] = t;\n", k - 1, k - 1, k - 2, k - 2);
+        break;
+    case PRIM_ROT:
+        out("    t = d[%d];\n    d[%d] = d[%d];\n    d[%d] = d[%d];\n    d[%d] = t;\n", k - 3, k - 3,
+            k - 2, k - 2, k - 1, k - 1);
+        break;
+    case PRIM_PICK:
+        out("    d[%d] = d[%d];\n", k - 1, k - 2 - (int)lit);
+        break;
+    case PRIM_PICKR:
+        out("    d[%d] = r[%d];\n", k - 1, j - 1 - (int)lit);
+        break;
+    case PRIM_JMP:
+        out("    goto L%04x;\n", (zf_addr)operand);
+        break;
+    case PRIM_JMP0:
+        out("    if (d[%d] == 0)\n        goto L%04x;\n", k - 1, (zf_addr)operand);
+        break;
+    case PRIM_PUSHR:
+        out("    r[%d] = d[%d];\n", j, k - 1);
+        break;
+    case PRIM_POPR:
+    case PRIM_I:
+        out("    d[%d] = r[%d];\n", k, j - 1);
+        break;
+    case PRIM_J:
+        out("    d[%d] = r[%d];\n", k, j - 4);
+        break;
+    case PRIM_LITS:
+        out("    d[%d] = %d;\n    d[%d] = %d;\n", k, (int)(next - n), k + 1, n);
+        break;
+    case PRIM_DO:
+        out("    r[%d] = %d;\n    r[%d] = d[%d];\n    r[%d] = d[%d];\n", j, n, j + 1, k - 2, j + 2, k - 1);
+        break;
+    case PRIM_LOOP:
+        out("    if (!(++r[%d] >= r[%d]))\n        goto L%04x;\n", j - 1, j - 2, (zf_addr)operand);
+        break;
+    case PRIM_LOOPP:
+        out("    r[%d] += d[%d];\n", j - 1, k - 1);
+        out("    if (!(r[%d] >= r[%d]))\n        goto L%04x;\n", j - 1, j - 2, (zf_addr)operand);
+        break;
+#if ZF_ENABLE_FUSION
+    case PRIM_LIT_ADD:
+    case PRIM_LIT_SUB:
+    case PRIM_LIT_MUL:
+        out("    d[%d] = d[%d] %c ", k - 1, k - 1, op == PRIM_LIT_ADD ? '+' : op == PRIM_LIT_SUB ? '-' : '*');
+        aot_const(operand, out);
+        out(";\n");
+        break;
+    case PRIM_LIT_PICK:
+        out("    d[%d] = d[%d];\n", k, k - 1 - n);
+        break;
+    case PRIM_LIT_PICKR:
+        out("    d[%d] = r[%d];\n", k, j - 1 - n);
+        break;
+    case PRIM_2DUP:
+        out("    d[%d] = d[%d];\n    d[%d] = d[%d];\n", k, k - 2, k + 1, k - 1);
+        break;
+    case PRIM_EQ_JMP0:
+        out("    if (!(d[%d] == d[%d]))\n        goto L%04x;\n", k - 2, k - 1, (zf_addr)operand);
+        break;
+    case PRIM_LTZ_JMP0:
+        out("    if (!(d[%d] < 0))\n        goto L%04x;\n", k - 1, (zf_addr)operand);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    if (binop)
+    {
+        out("    ");
+        out(binop, k - 2, k - 2, k - 1);
+    }
+}
+
+/**
+ * @brief  Emit the function with the code of a word. The function takes a
+ *         pointer to the cells the word takes from the data stack, and leaves
+ *         its results in their place
+ * @param  w: Address of the word
+ * @param  xt: Execution token of the word
+ * @param  end: End of the code of the word
+ * @param  out: Output function
+ * @return None
+ */
+static void aot_body(zf_addr w, zf_addr xt, zf_addr end, void (*out)(const char *fmt, ...))
+{
+    zf_verified *v = aot_check(xt, end);
+    zf_addr a, op, len;
+    zf_cell operand, lit = 0;
+    int i, size = v->need + v->max, rsize = 0;
+
+    /* v->rmax includes the return stack used by called words */
+
+    for (a = xt; a < end; a++)
+    {
+        if (verify_state[a - xt].seen)
+        {
+            int r = verify_state[a - xt].r;
+            scan_decode(a, &op, &operand);
+            r += op == PRIM_PUSHR ? 1 : op == PRIM_DO ? 3 : 0;
+            rsize = r > rsize ? r : rsize;
+        }
+    }
+
+    out("\n");
+    aot_name(w, out);
+    out("static void aot_w%04x(zf_cell *s)\n{\n", xt);
+    out("    zf_cell d[%d], t;\n", size > 0 ? size : 1);
+    if (rsize > 0)
+    {
+        out("    zf_cell r[%d];\n", rsize);
+    }
+    out("    (void)t;\n");
+    for (i = 0; i < v->need; i++)
+    {
+        out("    d[%d] = s[%d];\n", i, i);
+    }
+
+    for (a = xt; a < end;)
+    {
+        if (!verify_state[a - xt].seen)
+        {
+            a++;
+            continue;
+        }
+        len = scan_decode(a, &op, &operand);
+        if (aot_target[a - xt])
+        {
+            out("L%04x:\n", a);
+        }
+        if (op == PRIM_EXIT)
+        {
+            for (i = 0; i < v->need + v->net; i++)
+            {
+                out("    s[%d] = d[%d];\n", i, i);
+            }
+            out("    return;\n");
+        }
+        else
+        {
+            aot_instruction(op, operand, lit, a + len, v->need + verify_state[a - xt].d, verify_state[a - xt].r,
+                            out);
+        }
+        lit = operand;
+        a += len;
+    }
+    out("}\n");
+}
+
+/**
+ * @brief  Emit the function for a word in zf_aot_words[], which moves the
+ *         cells of the word between the data stack and the function with the
+ *         code of the word
+ * @param  w: Address of the word
+ * @param  xt: Execution token of the word
+ * @param  out: Output function
+ * @return None
+ */
+static void aot_entry_func(zf_addr w, zf_addr xt, void (*out)(const char *fmt, ...))
+{
+    zf_verified *v = verify_find(xt);
+    int i, size = v->need > v->need + v->net ? v->need : v->need + v->net;
+
+    out("\n");
+    aot_name(w, out);
+    out("static void aot_e%04x(void)\n{\n", xt);
+    out("    zf_cell s[%d];\n", size > 0 ? size : 1);
+    for (i = v->need - 1; i >= 0; i--)
+    {
+        out("    s[%d] = zf_pop();\n", i);
+    }
+    out("    aot_w%04x(s);\n", xt);
+    for (i = 0; i < v->need + v->net; i++)
+    {
+        out("    zf_push(s[%d]);\n", i);
+    }
+    out("}\n");
+}
+
+/**
+ * @brief  Translate words to C and replace their code in the dictionary by a
+ *         call through zf_aot_words[]. The words called by translated words
+ *         are translated as well, but keep their code in the dictionary
+ * @param  start: Only words defined at or above this address are replaced
+ * @param  select: Function deciding which words to replace by their name, or
+ *         NULL to replace the words with a loop, which are the ones most
+ *         likely to run long enough to make up for passing the cells through
+ *         the data stack
+ * @param  out: Function to write the generated C code with, called with
+ *         printf() style arguments
+ * @return Number of replaced words
+ */
+zf_addr zf_aot_translate(zf_addr start, int (*select)(const char *name, size_t len),
+                         void (*out)(const char *fmt, ...))
+{
+    zf_addr n, i, w, xt, end, count = 0;
+    zf_cell d;
+
+    memset(aot_ok, 0, sizeof(aot_ok));
+    memset(aot_need, 0, sizeof(aot_need));
+    memset(aot_entry, 0, sizeof(aot_entry));
+
+    /* Find out which words can be translated, oldest first so the called words
+     * are known when a word is checked. A word is replaced if it is selected
+     * and the call fits in its code, and every word called by a translated
+     * word needs a function as well */
+
+    for (n = 0; aot_word(n, &end); n++)
+        ;
+
+    for (i = n; i-- > 0;)
+    {
+        w = aot_word(i, &end);
+        dict_get_cell(w, &d);
+        xt = word_xt(w);
+        if (!((int)d & (ZF_FLAG_PRIM | ZF_FLAG_IMMEDIATE)) && aot_check(xt, end))
+        {
+            AOT_SET(aot_ok, xt);
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        w = aot_word(i, &end);
+        xt = word_xt(w);
+        if (!AOT_TEST(aot_ok, xt))
+        {
+            continue;
+        }
+        aot_check(xt, end);
+        if (w >= start && end - xt >= aot_cell_size(PRIM_AOT) + aot_cell_size(n) + aot_cell_size(PRIM_EXIT))
+        {
+            dict_get_cell(w, &d);
+            if (select ? select((const char *)DICT_MEM(xt - ZF_FLAG_LEN((int)d)), ZF_FLAG_LEN((int)d)) : aot_loop)
+            {
+                AOT_SET(aot_entry, xt);
+                AOT_SET(aot_need, xt);
+            }
+        }
+        if (AOT_TEST(aot_need, xt))
+        {
+            zf_addr a, op;
+            zf_cell operand;
+            for (a = xt; a < end; a++)
+            {
+                if (verify_state[a - xt].seen && (scan_decode(a, &op, &operand), op >= PRIM_COUNT))
+                {
+                    AOT_SET(aot_need, op);
+                }
+            }
+        }
+    }
+
+    out("/* Generated by zf_aot_translate(), do not edit */\n\n#include \"zforth.h\"\n");
+
+    for (i = n; i-- > 0;)
+    {
+        w = aot_word(i, &end);
+        xt = word_xt(w);
+        if (AOT_TEST(aot_need, xt))
+        {
+            aot_body(w, xt, end, out);
+        }
+        if (AOT_TEST(aot_entry, xt))
+        {
+            aot_entry_func(w, xt, out);
+        }
+    }
+
+    /* Replace the code of the selected words, numbering them in the same
+     * order as the table */
+
+    out("\nconst zf_aot_word zf_aot_words[] = {\n");
+    count = 0;
+    for (i = n; i-- > 0;)
+    {
+        w = aot_word(i, &end);
+        xt = word_xt(w);
+        if (AOT_TEST(aot_entry, xt))
+        {
+            zf_addr a = xt;
+            out("    aot_e%04x,\n", xt);
+            a += dict_put_cell(a, PRIM_AOT);
+            a += dict_put_cell(a, count);
+            dict_put_cell(a, PRIM_EXIT);
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        out("    NULL,\n");
+    }
+    out("};\n\nconst zf_addr zf_aot_count = %d;\n", (int)count);
+
+    return count;
+}
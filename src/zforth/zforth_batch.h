@@ -0,0 +1,231 @@
+/* Batch evaluation on a pool of threads. This file is included by zforth.c
+ * when ZF_ENABLE_BATCH is set, and only uses the public API.
+ *
+ * Every thread runs its jobs in a context of its own, so no context is used
+ * by more than one thread at a time. Every job starts from the state the
+ * context had when the batch started: the stacks are emptied, and words
+ * and compile state left by the previous job are dropped, so the result of
+ * a job does not depend on which thread ran it. The jobs are split into one contiguous
+ * range per thread. A thread takes jobs from the front of its own range, and
+ * when that is empty it steals the back half of the largest range left, so
+ * threads which got cheap jobs help out the ones which got expensive jobs.
+ * Stealing from the back keeps the owner and the thief apart, and every job
+ * moves at most once per steal. */
+
+typedef struct zf_batch_worker
+{
+    pthread_mutex_t lock;        /* Protects head and tail */
+    size_t head;                 /* Next job to run */
+    size_t tail;                 /* End of the range of jobs */
+    zf_ctx *ctx;                 /* Context to run the jobs in */
+    zf_cell here;                /* HERE of the context before the batch */
+    zf_cell latest;              /* LATEST of the context before the batch */
+    zf_job *jobs;                /* All jobs of the batch */
+    struct zf_batch_worker *all; /* All workers of the batch */
+    size_t count;                /* Number of workers */
+    pthread_t thread;            /* Thread of the worker */
+    int started;                 /* Set if the thread was created */
+} zf_batch_worker;
+
+/**
+ * @brief      Take the next job of a worker, or steal jobs from another one
+ *             if it has none left
+ * @param      w: Worker
+ * @param[out] job: Index of the job
+ * @return     1 if a job was taken, 0 if all jobs are taken
+ */
+static int batch_take(zf_batch_worker *w, size_t *job)
+{
+    zf_batch_worker *victim;
+    size_t i, n, best;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+    {
+        *job = w->head++;
+        pthread_mutex_unlock(&w->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (;;)
+    {
+        victim = NULL;
+        best = 0;
+        for (i = 0; i < w->count; i++)
+        {
+            pthread_mutex_lock(&w->all[i].lock);
+            n = w->all[i].tail - w->all[i].head;
+            pthread_mutex_unlock(&w->all[i].lock);
+            if (n > best)
+            {
+                best = n;
+                victim = &w->all[i];
+            }
+        }
+        if (victim == NULL)
+        {
+            return 0;
+        }
+
+        /* The victim may have taken more jobs since it was chosen */
+
+        pthread_mutex_lock(&victim->lock);
+        n = victim->tail - victim->head;
+        if (n == 0)
+        {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        n = (n + 1) / 2;
+        victim->tail -= n;
+        *job = victim->tail;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&w->lock);
+        w->head = *job + 1;
+        w->tail = *job + n;
+        pthread_mutex_unlock(&w->lock);
+        return 1;
+    }
+}
+
+/**
+ * @brief  Bring the context of a worker back to the state it had before the
+ *         batch, with empty stacks
+ * @param  w: Worker
+ * @return None
+ */
+static void batch_reset(zf_batch_worker *w)
+{
+    zf_ctx_uservar_set(w->ctx, ZF_USERVAR_DSP, 0);
+    zf_ctx_uservar_set(w->ctx, ZF_USERVAR_RSP, 0);
+    zf_ctx_uservar_set(w->ctx, ZF_USERVAR_COMPILING, 0);
+    zf_ctx_uservar_set(w->ctx, ZF_USERVAR_HERE, w->here);
+    zf_ctx_uservar_set(w->ctx, ZF_USERVAR_LATEST, w->latest);
+}
+
+/**
+ * @brief  Run a job in the context of a worker
+ * @param  w: Worker
+ * @param  job: Job to run
+ * @return None
+ */
+static void batch_run(zf_batch_worker *w, zf_job *job)
+{
+    zf_ctx *c = w->ctx;
+    zf_addr i, n;
+    zf_cell depth, compiling;
+
+    job->out_count = 0;
+    batch_reset(w);
+
+    for (i = 0; i < job->in_count; i++)
+    {
+        job->result = zf_ctx_push(c, job->in[i]);
+        if (job->result != ZF_OK)
+        {
+            return;
+        }
+    }
+
+    job->result = job->src ? zf_ctx_eval(c, job->src) : zf_ctx_execute(c, job->xt);
+
+    /* A definition can not be finished by a later job */
+
+    zf_ctx_uservar_get(c, ZF_USERVAR_COMPILING, &compiling);
+    if (job->result == ZF_OK && compiling)
+    {
+        job->result = ZF_ABORT_COMPILE_ONLY_WORD;
+    }
+
+    zf_ctx_uservar_get(c, ZF_USERVAR_DSP, &depth);
+    n = (zf_addr)depth < job->out_size ? (zf_addr)depth : job->out_size;
+    for (i = 0; i < n; i++)
+    {
+        zf_ctx_pick(c, n - 1 - i, &job->out[i]);
+    }
+    job->out_count = n;
+}
+
+/**
+ * @brief     Run jobs until all jobs of the batch are taken
+ * @param[in] arg: Worker
+ * @return    NULL
+ */
+static void *batch_worker(void *arg)
+{
+    zf_batch_worker *w = arg;
+    size_t job;
+
+    while (batch_take(w, &job))
+    {
+        batch_run(w, &w->jobs[job]);
+    }
+    batch_reset(w);
+    return NULL;
+}
+
+/**
+ * @brief         Run a batch of jobs on a pool of threads, one for each
+ *                context. The calling thread works on the first context. The
+ *                host callbacks are called from all threads at the same time
+ * @param[in]     ctxs: Contexts to run the jobs in
+ * @param         ctx_count: Number of contexts
+ * @param[in,out] jobs: Jobs to run; their results are stored in place
+ * @param         job_count: Number of jobs
+ * @return        ZF_OK, ZF_ABORT_INVALID_SIZE without contexts, or
+ *                ZF_ABORT_INTERNAL_ERROR if the pool could not be set up
+ */
+zf_result zf_eval_batch(zf_ctx **ctxs, size_t ctx_count, zf_job *jobs, size_t job_count)
+{
+    zf_batch_worker *w;
+    size_t i;
+
+    if (ctx_count == 0)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+    w = malloc(ctx_count * sizeof(*w));
+    if (w == NULL)
+    {
+        return ZF_ABORT_INTERNAL_ERROR;
+    }
+
+    for (i = 0; i < ctx_count; i++)
+    {
+        pthread_mutex_init(&w[i].lock, NULL);
+        w[i].head = job_count * i / ctx_count;
+        w[i].tail = job_count * (i + 1) / ctx_count;
+        w[i].ctx = ctxs[i];
+        zf_ctx_uservar_get(ctxs[i], ZF_USERVAR_HERE, &w[i].here);
+        zf_ctx_uservar_get(ctxs[i], ZF_USERVAR_LATEST, &w[i].latest);
+        w[i].jobs = jobs;
+        w[i].all = w;
+        w[i].count = ctx_count;
+        w[i].started = 0;
+    }
+
+    /* Jobs of a worker whose thread can not be created are stolen by the
+     * others */
+
+    for (i = 1; i < ctx_count; i++)
+    {
+        w[i].started = pthread_create(&w[i].thread, NULL, batch_worker, &w[i]) == 0;
+    }
+    batch_worker(&w[0]);
+
+    for (i = 0; i < ctx_count; i++)
+    {
+        if (w[i].started)
+        {
+            pthread_join(w[i].thread, NULL);
+        }
+    }
+    for (i = 0; i < ctx_count; i++)
+    {
+        pthread_mutex_destroy(&w[i].lock);
+    }
+    free(w);
+    return ZF_OK;
+}
@@ -0,0 +1,941 @@
+/* Native code generator for x86-64. This file is included by zforth.c when
+ * ZF_ENABLE_JIT is set, and translates words which passed the stack effect
+ * verification into machine code in an executable arena mapped with mmap().
+ * Every context has its own arena, which is mapped when the first word is
+ * compiled and unmapped by zf_ctx_release().
+ *
+ * Since verify() knows the depth of both stacks at every instruction of a
+ * verified word, the generated code addresses stack cells at fixed offsets
+ * from the stack depths at entry of the word, and never keeps a stack
+ * pointer. The frame bases live in two callee saved registers:
+ *
+ *   rbx  address of the data stack cell at the depth the word was entered at
+ *   r12  address of the return stack cell at the depth the word was entered
+ *        at, just above the return address of the word
+ *
+ * All cells are kept in memory between instructions, and calls between
+ * compiled words store the return address on the forth return stack as the
+ * interpreter would. This makes the state at every instruction the same as
+ * in the interpreter, so compiled code can leave at any instruction and have
+ * run() continue from there. This is used for everything the generated code
+ * does not handle itself: division by zero, access to the stack pointer user
+ * variables and writes to the code of verified words.
+ *
+ * Only floating point cells of type float or double are supported. Words
+ * which can not be compiled just keep running in the interpreter. */
+
+typedef struct
+{
+    zf_cell *dsp; /* Data stack pointer at the exit */
+    zf_cell *rsp; /* Return stack pointer at the exit */
+    uint32_t ip;  /* Instruction to continue at */
+} zf_jit_exit;
+
+typedef int (*zf_jit_entry)(zf_cell *dsp, zf_cell *rsp, zf_jit_exit *e, const uint8_t *code);
+typedef int (*zf_jit_helper)(zf_cell *dsp, zf_cell *rsp);
+
+/* Registers for the stack frame bases, as used in jit_mem() */
+
+#define JIT_DS 3  /* rbx */
+#define JIT_RS 12 /* r12 */
+
+/* Prefix of the scalar SSE instructions for the cell type */
+
+#define JIT_SSE (sizeof(zf_cell) == 4 ? 0xf3 : 0xf2)
+
+#define JIT_EMIT(s) jit_emit(s, sizeof(s) - 1)
+
+/* Native address of every instruction, and the branches and exits to patch
+ * once all of them are known, for the word being compiled */
+
+static ZF_THREAD_LOCAL uint32_t jit_label[ZF_VERIFY_CODE_MAX];
+
+static ZF_THREAD_LOCAL struct
+{
+    uint32_t pos;   /* Position of the rel32 to patch */
+    zf_addr target; /* Branch target */
+} jit_branch[ZF_VERIFY_CODE_MAX * 2];
+
+static ZF_THREAD_LOCAL struct
+{
+    uint32_t pos;   /* Position of the rel32 to patch */
+    zf_addr ip;     /* Instruction to continue at */
+    int8_t d;       /* Data stack depth at the exit */
+    uint8_t r;      /* Return stack depth at the exit */
+    int8_t d_after; /* Data stack depth after the instruction, helpers only */
+    zf_addr next;   /* Instruction after this one, helpers only */
+} jit_exit[ZF_VERIFY_CODE_MAX];
+
+static ZF_THREAD_LOCAL int jit_branches;
+static ZF_THREAD_LOCAL int jit_exits;
+
+/**
+ * @brief     Append bytes to the arena
+ * @param[in] buf: Bytes to append
+ * @param     len: Number of bytes
+ * @return    None
+ * @note      Bytes beyond the end of the arena are dropped, the caller checks
+ *            jit_here when done
+ */
+static void jit_emit(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    for (; len--; ctx->jit_here++, p++)
+    {
+        if (ctx->jit_here < ZF_JIT_SIZE)
+        {
+            ctx->jit_arena[ctx->jit_here] = *p;
+        }
+    }
+}
+
+/**
+ * @brief  Append a 32 bit little endian value to the arena
+ * @param  v: Value to append
+ * @return None
+ */
+static void jit_u32(uint32_t v)
+{
+    uint8_t b[4];
+    b[0] = v;
+    b[1] = v >> 8;
+    b[2] = v >> 16;
+    b[3] = v >> 24;
+    jit_emit(b, 4);
+}
+
+/**
+ * @brief  Patch a rel32 field to point at the given position
+ * @param  pos: Position of the rel32 field
+ * @param  target: Position to point at
+ * @return None
+ */
+static void jit_patch(size_t pos, size_t target)
+{
+    size_t here = ctx->jit_here;
+    ctx->jit_here = pos;
+    jit_u32(target - (pos + 4));
+    ctx->jit_here = here;
+}
+
+/**
+ * @brief  Append a memory operand for a stack cell
+ * @param  reg: Register field of the ModRM byte
+ * @param  base: JIT_DS or JIT_RS
+ * @param  index: Index of the cell relative to the frame base
+ * @return None
+ */
+static void jit_mem(int reg, int base, int index)
+{
+    uint8_t b[2];
+    b[0] = 0x80 | reg << 3 | (base & 7);
+    b[1] = 0x24;
+    jit_emit(b, base == JIT_RS ? 2 : 1);
+    jit_u32(index * (int)sizeof(zf_cell));
+}
+
+/**
+ * @brief  Append an instruction with a two byte opcode and a stack cell
+ *         operand, like the SSE arithmetic and conversions
+ * @param  prefix: Mandatory prefix, 0 for none
+ * @param  op: Second opcode byte, following 0x0f
+ * @param  reg: Register field of the ModRM byte
+ * @param  base: JIT_DS or JIT_RS
+ * @param  index: Index of the cell relative to the frame base
+ * @return None
+ */
+static void jit_op2(int prefix, int op, int reg, int base, int index)
+{
+    uint8_t b[4];
+    int n = 0;
+    if (prefix)
+    {
+        b[n++] = prefix;
+    }
+    if (base == JIT_RS)
+    {
+        b[n++] = 0x41;
+    }
+    b[n++] = 0x0f;
+    b[n++] = op;
+    jit_emit(b, n);
+    jit_mem(reg, base, index);
+}
+
+/**
+ * @brief  Load a stack cell into xmm0 to xmm2
+ * @param  xmm: Register number
+ * @param  base: JIT_DS or JIT_RS
+ * @param  index: Index of the cell relative to the frame base
+ * @return None
+ */
+static void jit_load(int xmm, int base, int index)
+{
+    jit_op2(JIT_SSE, 0x10, xmm, base, index);
+}
+
+/**
+ * @brief  Store xmm0 to xmm2 into a stack cell
+ * @param  xmm: Register number
+ * @param  base: JIT_DS or JIT_RS
+ * @param  index: Index of the cell relative to the frame base
+ * @return None
+ */
+static void jit_store(int xmm, int base, int index)
+{
+    jit_op2(JIT_SSE, 0x11, xmm, base, index);
+}
+
+/**
+ * @brief  Compare xmm0 or xmm1 with a stack cell
+ * @param  xmm: Register number
+ * @param  base: JIT_DS or JIT_RS
+ * @param  index: Index of the cell relative to the frame base
+ * @return None
+ */
+static void jit_compare(int xmm, int base, int index)
+{
+    jit_op2(sizeof(zf_cell) == 4 ? 0 : 0x66, 0x2e, xmm, base, index);
+}
+
+/**
+ * @brief  Append the bits of a cell value as an immediate
+ * @param  v: Value
+ * @return None
+ */
+static void jit_imm(zf_cell v)
+{
+    uint8_t b[sizeof(zf_cell)];
+    memcpy(b, &v, sizeof(v));
+    jit_emit(b, sizeof(v));
+}
+
+/**
+ * @brief  Store a constant into a stack cell
+ * @param  base: JIT_DS or JIT_RS
+ * @param  index: Index of the cell relative to the frame base
+ * @param  v: Value to store
+ * @return None
+ */
+static void jit_store_const(int base, int index, zf_cell v)
+{
+    if (sizeof(zf_cell) == 4)
+    {
+        if (base == JIT_RS)
+        {
+            JIT_EMIT("\x41");
+        }
+        JIT_EMIT("\xc7"); /* mov dword [base + index], v */
+        jit_mem(0, base, index);
+        jit_imm(v);
+    }
+    else
+    {
+        JIT_EMIT("\x48\xb8"); /* mov rax, v */
+        jit_imm(v);
+        jit_emit(base == JIT_RS ? "\x49\x89" : "\x48\x89", 2); /* mov [base + index], rax */
+        jit_mem(0, base, index);
+    }
+}
+
+/**
+ * @brief  Load a constant into xmm1
+ * @param  v: Value to load
+ * @return None
+ */
+static void jit_const(zf_cell v)
+{
+    if (sizeof(zf_cell) == 4)
+    {
+        JIT_EMIT("\xb8");             /* mov eax, v */
+        jit_imm(v);
+        JIT_EMIT("\x66\x0f\x6e\xc8"); /* movd xmm1, eax */
+    }
+    else
+    {
+        JIT_EMIT("\x48\xb8");             /* mov rax, v */
+        jit_imm(v);
+        JIT_EMIT("\x66\x48\x0f\x6e\xc8"); /* movq xmm1, rax */
+    }
+}
+
+/**
+ * @brief  Apply an SSE arithmetic instruction to xmm0 and xmm1
+ * @param  op: Second opcode byte: 0x58 add, 0x59 mul, 0x5c sub, 0x5e div
+ * @return None
+ */
+static void jit_arith(int op)
+{
+    uint8_t b[4];
+    b[0] = JIT_SSE;
+    b[1] = 0x0f;
+    b[2] = op;
+    b[3] = 0xc1;
+    jit_emit(b, 4);
+}
+
+/**
+ * @brief  Convert the integer in eax into a cell in xmm0
+ * @param  None
+ * @return None
+ */
+static void jit_from_int(void)
+{
+    uint8_t b[4];
+    b[0] = JIT_SSE;
+    b[1] = 0x0f;
+    b[2] = 0x2a;
+    b[3] = 0xc0; /* cvtsi2s xmm0, eax */
+    jit_emit(b, 4);
+}
+
+/**
+ * @brief  Convert the flag in al into a cell in xmm0
+ * @param  None
+ * @return None
+ */
+static void jit_flag(void)
+{
+    JIT_EMIT("\x0f\xb6\xc0"); /* movzx eax, al */
+    jit_from_int();
+}
+
+/**
+ * @brief  Append a conditional or unconditional jump to an instruction of the
+ *         word being compiled
+ * @param  op: Jump opcode, "\xe9" for jmp or "\x0f\x8X" for jcc
+ * @param  target: Forth address of the target instruction
+ * @return None
+ */
+static void jit_jump(const char *op, zf_addr target)
+{
+    jit_emit(op, op[0] == '\x0f' ? 2 : 1);
+    jit_branch[jit_branches].pos = ctx->jit_here;
+    jit_branch[jit_branches++].target = target;
+    jit_u32(0);
+}
+
+/**
+ * @brief  Append a conditional jump leaving the compiled code
+ * @param  op: Jump opcode, "\x0f\x8X"
+ * @param  ip: Instruction to continue at in the interpreter
+ * @param  d: Data stack depth to continue with
+ * @param  r: Return stack depth to continue with
+ * @return Exit record, for helpers to add the state after the instruction
+ */
+static int jit_side_exit(const char *op, zf_addr ip, int d, int r)
+{
+    int n = jit_exits++;
+    jit_emit(op, 2);
+    jit_exit[n].pos = ctx->jit_here;
+    jit_exit[n].ip = ip;
+    jit_exit[n].d = d;
+    jit_exit[n].r = r;
+    jit_exit[n].next = 0;
+    jit_u32(0);
+    return n;
+}
+
+/**
+ * @brief  Append the code setting up the exit state and leaving to the
+ *         trampoline
+ * @param  ip: Instruction to continue at in the interpreter
+ * @param  d: Data stack depth to continue with
+ * @param  r: Return stack depth to continue with
+ * @return None
+ */
+static void jit_exit_stub(zf_addr ip, int d, int r)
+{
+    JIT_EMIT("\xb8"); /* mov eax, ip */
+    jit_u32(ip);
+    JIT_EMIT("\x48\x8d\x93"); /* lea rdx, [rbx + d] */
+    jit_u32(d * (int)sizeof(zf_cell));
+    JIT_EMIT("\x49\x8d\x8c\x24"); /* lea rcx, [r12 + r] */
+    jit_u32(r * (int)sizeof(zf_cell));
+    JIT_EMIT("\xe9"); /* jmp exit */
+    jit_u32(ctx->jit_exit_common - (ctx->jit_here + 4));
+}
+
+/* Helpers for the primitives which access the dictionary. They get pointers
+ * just above the top of both stacks and return 0 to continue, 1 to leave the
+ * compiled code before the instruction, and 2 to leave after it */
+
+static int jit_peek(zf_cell *dsp, zf_cell *rsp)
+{
+    zf_addr addr = dsp[-2], len = dsp[-1];
+    if (IS_USERVAR(addr))
+    {
+        DSP = dsp - 2 - ctx->dstack;
+        RSP = rsp - ctx->rstack;
+    }
+    peek(addr, &dsp[-2], len);
+    return 0;
+}
+
+static int jit_len(zf_cell *dsp, zf_cell *rsp)
+{
+    zf_cell v;
+    zf_addr addr = dsp[-2], len = dsp[-1];
+    if (IS_USERVAR(addr))
+    {
+        DSP = dsp - 2 - ctx->dstack;
+        RSP = rsp - ctx->rstack;
+    }
+    dsp[-2] = peek(addr, &v, len);
+    return 0;
+}
+
+static int jit_poke(zf_cell *dsp, zf_cell *rsp)
+{
+    zf_addr addr = dsp[-2];
+    if (IS_USERVAR(addr))
+    {
+        return 1;
+    }
+    poke(addr, dsp[-3], dsp[-1]);
+    return ctx->verify_dropped ? 2 : 0;
+}
+
+static int jit_comma(zf_cell *dsp, zf_cell *rsp)
+{
+    dict_add_cell_typed(dsp[-2], (zf_mem_size)dsp[-1]);
+    return ctx->verify_dropped ? 2 : 0;
+}
+
+/**
+ * @brief  Append a call to a helper
+ * @param  fn: Helper to call
+ * @param  a: Address of the instruction
+ * @param  next: Address of the next instruction
+ * @param  d: Data stack depth before the instruction
+ * @param  r: Return stack depth
+ * @param  d_after: Data stack depth after the instruction
+ * @return None
+ */
+static void jit_helper(zf_jit_helper fn, zf_addr a, zf_addr next, int d, int r, int d_after)
+{
+    uint8_t b[sizeof(fn)];
+    int n;
+
+    JIT_EMIT("\x48\x8d\xbb"); /* lea rdi, [rbx + d] */
+    jit_u32(d * (int)sizeof(zf_cell));
+    JIT_EMIT("\x49\x8d\xb4\x24"); /* lea rsi, [r12 + r] */
+    jit_u32(r * (int)sizeof(zf_cell));
+    JIT_EMIT("\x48\xb8"); /* mov rax, fn */
+    memcpy(b, &fn, sizeof(fn));
+    jit_emit(b, sizeof(b));
+    JIT_EMIT("\xff\xd0\x85\xc0"); /* call rax; test eax, eax */
+    n = jit_side_exit("\x0f\x85", a, d, r);
+    jit_exit[n].next = next;
+    jit_exit[n].d_after = d_after;
+}
+
+/**
+ * @brief  Compile one instruction
+ * @param  a: Address of the instruction
+ * @param  op: Primitive or address of the called word
+ * @param  operand: Inline operand
+ * @param  len: Size of the instruction
+ * @param  d: Data stack depth before the instruction
+ * @param  r: Return stack depth before the instruction
+ * @return 1 if the instruction was compiled, 0 if it is not supported
+ */
+static int jit_instruction(zf_addr a, zf_addr op, zf_cell operand, zf_addr len, int d, int r)
+{
+    zf_verified *c;
+
+    if (op >= PRIM_COUNT)
+    {
+        /* The return address goes to the forth return stack, so the
+         * interpreter can pick up after an exit in the called word */
+
+        c = verify_find(op);
+        if (c == NULL || c->jit == 0)
+        {
+            return 0;
+        }
+        jit_store_const(JIT_RS, r, a + len);
+        if (d)
+        {
+            JIT_EMIT("\x48\x81\xc3"); /* add rbx, d */
+            jit_u32(d * (int)sizeof(zf_cell));
+        }
+        JIT_EMIT("\x49\x81\xc4"); /* add r12, r + 1 */
+        jit_u32((r + 1) * (int)sizeof(zf_cell));
+        JIT_EMIT("\xe8"); /* call word */
+        jit_u32(c->jit - 1 - (ctx->jit_here + 4));
+        if (d)
+        {
+            JIT_EMIT("\x48\x81\xeb"); /* sub rbx, d */
+            jit_u32(d * (int)sizeof(zf_cell));
+        }
+        JIT_EMIT("\x49\x81\xec"); /* sub r12, r + 1 */
+        jit_u32((r + 1) * (int)sizeof(zf_cell));
+        return 1;
+    }
+
+    switch (op)
+    {
+    case PRIM_EXIT:
+        JIT_EMIT("\x48\x83\xc4\x08\xc3"); /* add rsp, 8; ret */
+        break;
+    case PRIM_LIT:
+        jit_store_const(JIT_DS, d, operand);
+        break;
+    case PRIM_LTZ:
+        JIT_EMIT("\x0f\x57\xc9"); /* xorps xmm1, xmm1 */
+        jit_compare(1, JIT_DS, d - 1);
+        JIT_EMIT("\x0f\x97\xc0"); /* seta al */
+        jit_flag();
+        jit_store(0, JIT_DS, d - 1);
+        break;
+    case PRIM_DIV:
+        jit_load(1, JIT_DS, d - 1);
+        JIT_EMIT("\x0f\x57\xd2"); /* xorps xmm2, xmm2 */
+        if (sizeof(zf_cell) == 8)
+        {
+            JIT_EMIT("\x66");
+        }
+        JIT_EMIT("\x0f\x2e\xca\x7a\x06"); /* ucomis xmm1, xmm2; jp +6 */
+        jit_side_exit("\x0f\x84", a, d, r);
+        /* fall through */
+    case PRIM_ADD:
+    case PRIM_SUB:
+    case PRIM_MUL:
+        jit_load(0, JIT_DS, d - 2);
+        jit_op2(JIT_SSE, op == PRIM_ADD ? 0x58 : op == PRIM_SUB ? 0x5c : op == PRIM_MUL ? 0x59 : 0x5e,
+                0, JIT_DS, d - 1);
+        jit_store(0, JIT_DS, d - 2);
+        break;
+    case PRIM_MOD:
+        jit_op2(JIT_SSE, 0x2c, 1, JIT_DS, d - 1); /* cvtts2si ecx, d2 */
+        JIT_EMIT("\x85\xc9");                     /* test ecx, ecx */
+        jit_side_exit("\x0f\x84", a, d, r);
+        jit_op2(JIT_SSE, 0x2c, 0, JIT_DS, d - 2); /* cvtts2si eax, d1 */
+        JIT_EMIT("\x99\xf7\xf9\x89\xd0");         /* cdq; idiv ecx; mov eax, edx */
+        jit_from_int();
+        jit_store(0, JIT_DS, d - 2);
+        break;
+    case PRIM_DROP:
+    case PRIM_UNLOOP:
+        break;
+    case PRIM_DUP:
+        jit_load(0, JIT_DS, d - 1);
+        jit_store(0, JIT_DS, d);
+        break;
+    case PRIM_SWAP:
+        jit_load(0, JIT_DS, d - 1);
+        jit_load(1, JIT_DS, d - 2);
+        jit_store(0, JIT_DS, d - 2);
+        jit_store(1, JIT_DS, d - 1);
+        break;
+    case PRIM_ROT:
+        jit_load(0, JIT_DS, d - 3);
+        jit_load(1, JIT_DS, d - 2);
+        jit_load(2, JIT_DS, d - 1);
+        jit_store(1, JIT_DS, d - 3);
+        jit_store(2, JIT_DS, d - 2);
+        jit_store(0, JIT_DS, d - 1);
+        break;
+    case PRIM_JMP:
+        jit_jump("\xe9", operand);
+        break;
+    case PRIM_JMP0:
+        jit_load(0, JIT_DS, d - 1);
+        JIT_EMIT("\x0f\x57\xc9"); /* xorps xmm1, xmm1 */
+        if (sizeof(zf_cell) == 8)
+        {
+            JIT_EMIT("\x66");
+        }
+        JIT_EMIT("\x0f\x2e\xc1\x7a\x06"); /* ucomis xmm0, xmm1; jp +6 */
+        jit_jump("\x0f\x84", operand);
+        break;
+    case PRIM_PUSHR:
+        jit_load(0, JIT_DS, d - 1);
+        jit_store(0, JIT_RS, r);
+        break;
+    case PRIM_POPR:
+        jit_load(0, JIT_RS, r - 1);
+        jit_store(0, JIT_DS, d);
+        break;
+    case PRIM_EQUAL:
+        jit_load(0, JIT_DS, d - 2);
+        jit_compare(0, JIT_DS, d - 1);
+        JIT_EMIT("\x0f\x94\xc0\x0f\x9b\xc1\x20\xc8"); /* sete al; setnp cl; and al, cl */
+        jit_flag();
+        jit_store(0, JIT_DS, d - 2);
+        break;
+    case PRIM_LITS:
+        jit_store_const(JIT_DS, d, a + len - (zf_addr)operand);
+        jit_store_const(JIT_DS, d + 1, operand);
+        break;
+    case PRIM_PEEK:
+        jit_helper(jit_peek, a, a + len, d, r, d - 1);
+        break;
+    case PRIM_LEN:
+        jit_helper(jit_len, a, a + len, d, r, d - 1);
+        break;
+    case PRIM_POKE:
+        jit_helper(jit_poke, a, a + len, d, r, d - 3);
+        break;
+    case PRIM_COMMA:
+        jit_helper(jit_comma, a, a + len, d, r, d - 2);
+        break;
+    case PRIM_AND:
+    case PRIM_OR:
+    case PRIM_XOR:
+    case PRIM_SHL:
+    case PRIM_SHR:
+        if (sizeof(zf_int) != 4)
+        {
+            return 0;
+        }
+        jit_op2(JIT_SSE, 0x2c, 0, JIT_DS, d - 2); /* cvtts2si eax, d2 */
+        jit_op2(JIT_SSE, 0x2c, 1, JIT_DS, d - 1); /* cvtts2si ecx, d1 */
+        jit_emit(op == PRIM_AND   ? "\x21\xc8"  /* and eax, ecx */
+                 : op == PRIM_OR  ? "\x09\xc8"  /* or eax, ecx */
+                 : op == PRIM_XOR ? "\x31\xc8"  /* xor eax, ecx */
+                 : op == PRIM_SHL ? "\xd3\xe0"  /* shl eax, cl */
+                                  : "\xd3\xf8", /* sar eax, cl */
+                 2);
+        jit_from_int();
+        jit_store(0, JIT_DS, d - 2);
+        break;
+    case PRIM_DO:
+        jit_store_const(JIT_RS, r, operand);
+        jit_load(0, JIT_DS, d - 2);
+        jit_store(0, JIT_RS, r + 1);
+        jit_load(0, JIT_DS, d - 1);
+        jit_store(0, JIT_RS, r + 2);
+        break;
+    case PRIM_LOOP:
+    case PRIM_LOOPP:
+        if (op == PRIM_LOOP)
+        {
+            jit_const(1);
+        }
+        else
+        {
+            jit_load(1, JIT_DS, d - 1);
+        }
+        jit_load(0, JIT_RS, r - 1);
+        jit_arith(0x58);
+        jit_store(0, JIT_RS, r - 1);
+        jit_compare(0, JIT_RS, r - 2);
+        jit_jump("\x0f\x82", operand); /* jb */
+        break;
+    case PRIM_I:
+    case PRIM_J:
+        jit_load(0, JIT_RS, op == PRIM_I ? r - 1 : r - 4);
+        jit_store(0, JIT_DS, d);
+        break;
+#if ZF_ENABLE_FUSION
+    case PRIM_LIT_ADD:
+    case PRIM_LIT_SUB:
+    case PRIM_LIT_MUL:
+        jit_load(0, JIT_DS, d - 1);
+        jit_const(operand);
+        jit_arith(op == PRIM_LIT_ADD ? 0x58 : op == PRIM_LIT_SUB ? 0x5c : 0x59);
+        jit_store(0, JIT_DS, d - 1);
+        break;
+    case PRIM_LIT_PICK:
+        jit_load(0, JIT_DS, d - 1 - (int)operand);
+        jit_store(0, JIT_DS, d);
+        break;
+    case PRIM_LIT_PICKR:
+        jit_load(0, JIT_RS, r - 1 - (int)operand);
+        jit_store(0, JIT_DS, d);
+        break;
+    case PRIM_2DUP:
+        jit_load(0, JIT_DS, d - 2);
+        jit_load(1, JIT_DS, d - 1);
+        jit_store(0, JIT_DS, d);
+        jit_store(1, JIT_DS, d + 1);
+        break;
+    case PRIM_EQ_JMP0:
+        jit_load(0, JIT_DS, d - 2);
+        jit_compare(0, JIT_DS, d - 1);
+        jit_jump("\x0f\x85", operand); /* jne */
+        jit_jump("\x0f\x8a", operand); /* jp */
+        break;
+    case PRIM_LTZ_JMP0:
+        JIT_EMIT("\x0f\x57\xc9"); /* xorps xmm1, xmm1 */
+        jit_compare(1, JIT_DS, d - 1);
+        jit_jump("\x0f\x86", operand); /* jbe */
+        break;
+#endif
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief  Map the arena and generate the trampoline into it
+ * @param  None
+ * @return 1 if the arena is usable
+ */
+static int jit_init(void)
+{
+    size_t out;
+    void *p;
+    uint8_t b[2];
+
+    if (ctx->jit_arena)
+    {
+        return 1;
+    }
+    if ((zf_cell)0.5 == 0 || (sizeof(zf_cell) != 4 && sizeof(zf_cell) != 8))
+    {
+        return 0;
+    }
+    p = mmap(NULL, ZF_JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return 0;
+    }
+    ctx->jit_arena = p;
+
+    /* int jit_enter(dsp, rsp, exit, code) */
+
+    JIT_EMIT("\x55\x53\x41\x54\x41\x55\x41\x56"); /* push rbp, rbx, r12, r13, r14 */
+    JIT_EMIT("\x48\x89\xfb");                     /* mov rbx, rdi */
+    JIT_EMIT("\x49\x89\xf4");                     /* mov r12, rsi */
+    JIT_EMIT("\x49\x89\xd6");                     /* mov r14, rdx */
+    JIT_EMIT("\x49\x89\xe5");                     /* mov r13, rsp */
+    JIT_EMIT("\xff\xd1");                         /* call rcx */
+    JIT_EMIT("\x31\xc0");                         /* xor eax, eax */
+    out = ctx->jit_here;
+    JIT_EMIT("\x41\x5e\x41\x5d\x41\x5c\x5b\x5d\xc3"); /* pop r14, r13, r12, rbx, rbp; ret */
+
+    /* Exits from compiled code arrive here with the instruction to continue
+     * at in eax and the stack pointers in rdx and rcx */
+
+    ctx->jit_exit_common = ctx->jit_here;
+    JIT_EMIT("\x4c\x89\xec");         /* mov rsp, r13 */
+    JIT_EMIT("\x49\x89\x16");         /* mov [r14], rdx */
+    JIT_EMIT("\x49\x89\x4e\x08");     /* mov [r14 + 8], rcx */
+    JIT_EMIT("\x41\x89\x46\x10");     /* mov [r14 + 16], eax */
+    JIT_EMIT("\xb8\x01\x00\x00\x00"); /* mov eax, 1 */
+    b[0] = 0xeb;                      /* jmp out */
+    b[1] = out - (ctx->jit_here + 2);
+    jit_emit(b, 2);
+
+    ctx->jit_start = ctx->jit_here;
+    return 1;
+}
+
+/**
+ * @brief  Unmap the arena of the current context
+ * @param  None
+ * @return None
+ */
+static void jit_release(void)
+{
+    if (ctx->jit_arena)
+    {
+        munmap(ctx->jit_arena, ZF_JIT_SIZE);
+        ctx->jit_arena = NULL;
+    }
+}
+
+/**
+ * @brief  Drop all compiled code. The verification records holding the
+ *         offsets into the arena are cleared by the caller
+ * @param  None
+ * @return None
+ * @note   Compiled code may still be running when this is called from a
+ *         helper, but only to reach an exit; the arena is not written to
+ *         before the next compilation
+ */
+static void jit_reset(void)
+{
+    ctx->jit_here = ctx->jit_start;
+}
+
+/**
+ * @brief  Compile a verified word to native code, together with the words it
+ *         calls
+ * @param  v: Verification record of the word
+ * @param  depth: Nesting depth of calls to compile
+ * @return 1 if the word is compiled, 0 if it runs in the interpreter
+ */
+static int jit_compile(zf_verified *v, int depth)
+{
+    zf_addr xt = v->xt, end = xt + ZF_VERIFY_CODE_MAX, a, b, op, len;
+    zf_cell operand;
+    size_t start;
+    int i;
+
+    if (v->jit)
+    {
+        return 1;
+    }
+    if (depth > 8 || !jit_init())
+    {
+        return 0;
+    }
+    if (end > ctx->dict_size)
+    {
+        end = ctx->dict_size;
+    }
+
+    /* Compile the called words first, since the code of a word is generated
+     * in one piece. verify() is run again to get the stack depths of every
+     * instruction, which are overwritten when compiling another word */
+
+again:
+    if (!verify(xt, end))
+    {
+        return 0;
+    }
+    for (a = xt; a < end; a++)
+    {
+        if (verify_state[a - xt].seen)
+        {
+            scan_decode(a, &op, &operand);
+            if (op >= PRIM_COUNT)
+            {
+                zf_verified *c = verify_find(op);
+                if (c == NULL)
+                {
+                    return 0;
+                }
+                if (!c->jit)
+                {
+                    if (!jit_compile(c, depth + 1))
+                    {
+                        return 0;
+                    }
+                    goto again;
+                }
+            }
+        }
+    }
+
+    start = ctx->jit_here;
+    jit_branches = 0;
+    jit_exits = 0;
+    JIT_EMIT("\x48\x83\xec\x08"); /* sub rsp, 8 */
+
+    for (a = xt; a < end;)
+    {
+        if (!verify_state[a - xt].seen)
+        {
+            a++;
+            continue;
+        }
+        len = scan_decode(a, &op, &operand);
+        for (b = a + 1; b < a + len && b < end; b++)
+        {
+            if (verify_state[b - xt].seen)
+            {
+                goto fail;
+            }
+        }
+        jit_label[a - xt] = ctx->jit_here;
+        if (!jit_instruction(a, op, operand, len, verify_state[a - xt].d, verify_state[a - xt].r))
+        {
+            goto fail;
+        }
+        a += len;
+    }
+
+    /* Exits are kept out of the way of the straight line code */
+
+    for (i = 0; i < jit_exits; i++)
+    {
+        jit_patch(jit_exit[i].pos, ctx->jit_here);
+        if (jit_exit[i].next)
+        {
+            size_t pos;
+            JIT_EMIT("\x83\xf8\x01\x0f\x85"); /* cmp eax, 1; jne after */
+            pos = ctx->jit_here;
+            jit_u32(0);
+            jit_exit_stub(jit_exit[i].ip, jit_exit[i].d, jit_exit[i].r);
+            jit_patch(pos, ctx->jit_here);
+            jit_exit_stub(jit_exit[i].next, jit_exit[i].d_after, jit_exit[i].r);
+        }
+        else
+        {
+            jit_exit_stub(jit_exit[i].ip, jit_exit[i].d, jit_exit[i].r);
+        }
+    }
+
+    if (ctx->jit_here > ZF_JIT_SIZE)
+    {
+        goto fail;
+    }
+    for (i = 0; i < jit_branches; i++)
+    {
+        jit_patch(jit_branch[i].pos, jit_label[jit_branch[i].target - xt]);
+    }
+
+    trace("\n jit " ZF_ADDR_FMT " %d bytes", xt, (int)(ctx->jit_here - start));
+    v->jit = start + 1;
+    return 1;
+
+fail:
+    ctx->jit_here = start;
+    return 0;
+}
+
+/**
+ * @brief  Count a call to a verified word, and compile it when it becomes
+ *         hot
+ * @param  v: Verification record of the word, may be NULL
+ * @return 1 if the word has native code to run
+ */
+static int jit_hot(zf_verified *v)
+{
+    if (v == NULL || TRACE)
+    {
+        return 0;
+    }
+#if ZF_ENABLE_YIELD
+    /* Native code does not count instructions */
+    if (ctx->steps)
+    {
+        return 0;
+    }
+#endif
+    if (v->jit)
+    {
+        return 1;
+    }
+    if (v->calls < ZF_JIT_THRESHOLD && ++v->calls == ZF_JIT_THRESHOLD)
+    {
+        return jit_compile(v, 0);
+    }
+    return 0;
+}
+
+/**
+ * @brief  Run the native code of a word. The return address has been pushed
+ *         and the stacks are saved, as for run_verified()
+ * @param  v: Verification record of the word
+ * @return 0 if the word returned, with ip at the return address, 1 if it left
+ *         the compiled code, with ip at the instruction to continue at
+ */
+static int jit_run(zf_verified *v)
+{
+    zf_jit_entry enter;
+    zf_jit_exit e;
+    zf_addr dsp = DSP, rsp = RSP;
+
+    memcpy(&enter, &ctx->jit_arena, sizeof(enter));
+    ctx->verify_dropped = 0;
+    if (!enter(ctx->dstack + dsp, ctx->rstack + rsp, &e, ctx->jit_arena + v->jit - 1))
+    {
+        DSP = dsp + v->net;
+        RSP = rsp - 1;
+        ctx->ip = ctx->rstack[rsp - 1];
+        return 0;
+    }
+    DSP = e.dsp - ctx->dstack;
+    RSP = e.rsp - ctx->rstack;
+    ctx->ip = e.ip;
+    return 1;
+}
@@ -0,0 +1,306 @@
+/* Parallel map and reduce over arrays in the dictionary. This file is
+ * included by zforth.c when ZF_ENABLE_PARALLEL is set.
+ *
+ * The array is split into one contiguous chunk per thread. Every thread
+ * works on a fork of the context, taken from a snapshot when the call
+ * starts, so the word sees the dictionary of the caller but can not disturb
+ * it or the other threads. A map writes its results into the dictionary of
+ * its fork, from where they are copied back to the caller when all threads
+ * are done. A reduce leaves one partial result per chunk, which are combined
+ * in order at the end, so the word only needs to be associative. */
+
+typedef struct
+{
+    zf_ctx *ctx;       /* Fork the chunk runs in */
+    zf_addr xt;        /* Word to apply */
+    zf_addr addr;      /* Address of the first element of the chunk */
+    zf_addr size;      /* Element size in bytes */
+    zf_addr count;     /* Number of elements in the chunk */
+    zf_mem_size type;  /* Memory access type of the elements */
+    int reduce;        /* Set to reduce instead of map */
+    zf_addr chunks;    /* Number of chunks, set in the first chunk */
+    zf_cell result;    /* Result of the reduction of the chunk */
+    zf_result r;       /* Result of running the chunk */
+    pthread_t thread;  /* Thread of the chunk */
+    int started;       /* Set if the thread was created */
+} zf_par_chunk;
+
+/**
+ * @brief  Get the memory access type for an element size
+ * @param  size: Element size in bytes
+ * @return Access type, or ZF_MEM_SIZE_VAR if the size is not supported
+ */
+static zf_mem_size par_type(zf_addr size)
+{
+    if (size == sizeof(zf_cell))
+    {
+        return ZF_MEM_SIZE_CELL;
+    }
+    switch (size)
+    {
+    case 1:
+        return ZF_MEM_SIZE_U8;
+    case 2:
+        return ZF_MEM_SIZE_S16;
+    case 4:
+        return ZF_MEM_SIZE_S32;
+    default:
+        return ZF_MEM_SIZE_VAR;
+    }
+}
+
+/**
+ * @brief     Apply the word to the elements of a chunk in the current context,
+ *            for ctx_call()
+ * @param[in] arg: Chunk
+ * @return    None
+ */
+static void par_run(const char *arg)
+{
+    zf_par_chunk *p = (zf_par_chunk *)arg;
+    zf_addr i, a = p->addr;
+    zf_cell v;
+
+    DSP = 0;
+    for (i = 0; i < p->count; i++, a += p->size)
+    {
+        dict_get_cell_typed(a, &v, p->type);
+        if (p->reduce)
+        {
+            if (i > 0)
+            {
+                zf_push(p->result);
+                zf_push(v);
+                execute(p->xt);
+                v = zf_pop();
+            }
+            p->result = v;
+        }
+        else
+        {
+            zf_push(v);
+            execute(p->xt);
+            dict_put_cell_typed(a, zf_pop(), p->type);
+        }
+    }
+}
+
+/**
+ * @brief     Run a chunk in its fork
+ * @param[in] arg: Chunk
+ * @return    NULL
+ */
+static void *par_thread(void *arg)
+{
+    zf_par_chunk *p = arg;
+
+    p->r = ctx_call(p->ctx, par_run, (const char *)p);
+    return NULL;
+}
+
+/**
+ * @brief     Combine the partial results of a reduction in order, for
+ *            ctx_call()
+ * @param[in] arg: Chunks, the first one is updated with the result
+ * @return    None
+ */
+static void par_combine(const char *arg)
+{
+    zf_par_chunk *p = (zf_par_chunk *)arg;
+    zf_addr i;
+
+    DSP = 0;
+    for (i = 1; i < p[0].chunks; i++)
+    {
+        zf_push(p[0].result);
+        zf_push(p[i].result);
+        execute(p[0].xt);
+        p[0].result = zf_pop();
+    }
+}
+
+/**
+ * @brief      Apply a word to an array in the dictionary on a number of
+ *             threads, as a map or a reduction
+ * @param      c: Context
+ * @param      reduce: Set to reduce instead of map
+ * @param      xt: Execution token of the word
+ * @param      addr: Address of the array
+ * @param      size: Element size in bytes
+ * @param      count: Number of elements
+ * @param      threads: Number of threads
+ * @param[out] result: Result of the reduction
+ * @return     Result of the operation
+ */
+static zf_result par_apply(zf_ctx *c, int reduce, zf_addr xt, zf_addr addr, zf_addr size, zf_addr count,
+                           size_t threads, zf_cell *result)
+{
+    zf_snapshot *s;
+    zf_par_chunk *p;
+    zf_addr i, n, start;
+    zf_result r = ZF_OK;
+    const uint8_t *src;
+    zf_ctx *prev;
+
+    if (par_type(size) == ZF_MEM_SIZE_VAR || (reduce && count == 0) || threads == 0)
+    {
+        return ZF_ABORT_INVALID_SIZE;
+    }
+    if (addr > c->dict_size || count > (c->dict_size - addr) / size)
+    {
+        return ZF_ABORT_OUTSIDE_MEM;
+    }
+    if (count == 0)
+    {
+        return ZF_OK;
+    }
+
+    n = threads < count ? (zf_addr)threads : count;
+    p = calloc(n, sizeof(*p));
+    s = zf_ctx_snapshot(c);
+    if (p == NULL || s == NULL)
+    {
+        free(p);
+        if (s)
+        {
+            zf_snapshot_release(s);
+        }
+        return ZF_ABORT_INTERNAL_ERROR;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        start = (zf_addr)((uint64_t)count * i / n);
+        p[i].ctx = zf_fork(s);
+        p[i].xt = xt;
+        p[i].addr = addr + start * size;
+        p[i].size = size;
+        p[i].count = (zf_addr)((uint64_t)count * (i + 1) / n) - start;
+        p[i].type = par_type(size);
+        p[i].reduce = reduce;
+        p[i].r = ZF_ABORT_INTERNAL_ERROR;
+    }
+
+    /* Chunks whose fork or thread could not be created fail the call */
+
+    for (i = 1; i < n; i++)
+    {
+        if (p[i].ctx)
+        {
+            p[i].started = pthread_create(&p[i].thread, NULL, par_thread, &p[i]) == 0;
+        }
+    }
+    if (p[0].ctx)
+    {
+        par_thread(&p[0]);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (p[i].started)
+        {
+            pthread_join(p[i].thread, NULL);
+        }
+        if (r == ZF_OK)
+        {
+            r = p[i].r;
+        }
+    }
+
+    if (r == ZF_OK && reduce)
+    {
+        p[0].chunks = n;
+        r = ctx_call(p[0].ctx, par_combine, (const char *)p);
+        *result = p[0].result;
+    }
+    if (r == ZF_OK && !reduce)
+    {
+        prev = ctx;
+        for (i = 0; i < n; i++)
+        {
+            ctx = p[i].ctx;
+            src = DICT_MEM(p[i].addr);
+            ctx = c;
+            dict_put_bytes(p[i].addr, src, p[i].count * size);
+        }
+        ctx = prev;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (p[i].ctx)
+        {
+            zf_fork_release(p[i].ctx);
+        }
+    }
+    zf_snapshot_release(s);
+    free(p);
+    return r;
+}
+
+/**
+ * @brief  Replace every element of an array in the dictionary of an
+ *         interpreter context by the result of a word, on a number of
+ *         threads. The array is left unchanged if the word aborts
+ * @param  c: Context
+ * @param  xt: Execution token of the word, ( x -- y )
+ * @param  addr: Address of the array
+ * @param  size: Element size in bytes
+ * @param  count: Number of elements
+ * @param  threads: Number of threads
+ * @return ZF_OK, ZF_ABORT_INVALID_SIZE or ZF_ABORT_OUTSIDE_MEM for an
+ *         invalid array, or the abort reason of the word
+ */
+zf_result zf_ctx_pmap(zf_ctx *c, zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads)
+{
+    return par_apply(c, 0, xt, addr, size, count, threads, NULL);
+}
+
+/**
+ * @brief  Replace every element of an array in the dictionary by the result
+ *         of a word, on a number of threads
+ * @param  xt: Execution token of the word
+ * @param  addr: Address of the array
+ * @param  size: Element size in bytes
+ * @param  count: Number of elements
+ * @param  threads: Number of threads
+ * @return Result of the operation
+ */
+zf_result zf_pmap(zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads)
+{
+    return zf_ctx_pmap(ctx, xt, addr, size, count, threads);
+}
+
+/**
+ * @brief      Reduce an array in the dictionary of an interpreter context
+ *             with an associative word, on a number of threads
+ * @param      c: Context
+ * @param      xt: Execution token of the word, ( x y -- z )
+ * @param      addr: Address of the array
+ * @param      size: Element size in bytes
+ * @param      count: Number of elements, at least 1
+ * @param      threads: Number of threads
+ * @param[out] result: Result of the reduction
+ * @return     ZF_OK, ZF_ABORT_INVALID_SIZE or ZF_ABORT_OUTSIDE_MEM for an
+ *             invalid array, or the abort reason of the word
+ */
+zf_result zf_ctx_preduce(zf_ctx *c, zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads,
+                         zf_cell *result)
+{
+    return par_apply(c, 1, xt, addr, size, count, threads, result);
+}
+
+/**
+ * @brief      Reduce an array in the dictionary with an associative word, on
+ *             a number of threads
+ * @param      xt: Execution token of the word
+ * @param      addr: Address of the array
+ * @param      size: Element size in bytes
+ * @param      count: Number of elements
+ * @param      threads: Number of threads
+ * @param[out] result: Result of the reduction
+ * @return     Result of the operation
+ */
+zf_result zf_preduce(zf_addr xt, zf_addr addr, zf_addr size, zf_addr count, size_t threads, zf_cell *result)
+{
+    return zf_ctx_preduce(ctx, xt, addr, size, count, threads, result);
+}
@@ -0,0 +1,730 @@
+/* The inner interpreter. This file is included by zforth.c, once to define
+ * run() and, with ZF_ENABLE_VERIFY, a second time with RUN_VERIFIED set to 1
+ * to define run_verified(). The second variant runs words which passed the
+ * stack effect verification in verify(); it has no stack checks and leaves
+ * out the primitives a verified word can not contain, handing control back
+ * to run() if it meets one of these anyway. */
+
+#undef STACK_CHECK
+#undef CHECKED_ONLY
+#undef VERIFIED_WRITE
+#undef INPUT_PENDING
+
+#if RUN_VERIFIED
+#define INPUT_PENDING 0
+#define STACK_CHECK(exp, abort)
+#define CHECKED_ONLY(label) &&L_unverified
+#define VERIFIED_WRITE()     \
+    if (ctx->verify_dropped) \
+    {                        \
+        SAVE();              \
+        return;              \
+    }
+#else
+#define INPUT_PENDING           (input != NULL)
+#define STACK_CHECK(exp, abort) CHECK(exp, abort)
+#define CHECKED_ONLY(label)     &&label
+#define VERIFIED_WRITE()
+#endif
+
+#if ZF_ENABLE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+#if RUN_VERIFIED
+/**
+ * @brief  Run verified words without stack checks until the word at the given
+ *         return stack depth returns, or an instruction is met which has to
+ *         be executed by run()
+ * @param  rbase: Return stack depth to return at
+ * @return None
+ */
+static void run_verified(zf_addr rbase)
+#else
+/**
+ * @brief     Run the inner interpreter
+ * @param[in] input: Input null-terminated string
+ * @return None
+ */
+static void run(const char *input)
+#endif
+{
+    zf_cell d1, d2, d3;
+    zf_addr i, addr, len, code, ip_org;
+#if ZF_ENABLE_DECODE_CACHE
+    zf_decoded *dc;
+#endif
+#if ZF_ENABLE_TOS_CACHE
+    zf_cell tos;
+    zf_addr dsp, rsp;
+#endif
+#if ZF_ENABLE_VERIFY && (!RUN_VERIFIED || ZF_ENABLE_JIT)
+    zf_verified *v;
+#endif
+
+#if ZF_ENABLE_COMPUTED_GOTO
+    static const void *const prim_labels[PRIM_COUNT] = {
+        [PRIM_EXIT] = &&L_PRIM_EXIT,
+        [PRIM_LIT] = &&L_PRIM_LIT,
+        [PRIM_LTZ] = &&L_PRIM_LTZ,
+        [PRIM_COL] = CHECKED_ONLY(L_PRIM_COL),
+        [PRIM_SEMICOL] = CHECKED_ONLY(L_PRIM_SEMICOL),
+        [PRIM_ADD] = &&L_PRIM_ADD,
+        [PRIM_SUB] = &&L_PRIM_SUB,
+        [PRIM_MUL] = &&L_PRIM_MUL,
+        [PRIM_DIV] = &&L_PRIM_DIV,
+        [PRIM_MOD] = &&L_PRIM_MOD,
+        [PRIM_DROP] = &&L_PRIM_DROP,
+        [PRIM_DUP] = &&L_PRIM_DUP,
+        [PRIM_PICKR] = &&L_PRIM_PICKR,
+        [PRIM_IMMEDIATE] = CHECKED_ONLY(L_PRIM_IMMEDIATE),
+        [PRIM_PEEK] = &&L_PRIM_PEEK,
+        [PRIM_POKE] = &&L_PRIM_POKE,
+        [PRIM_SWAP] = &&L_PRIM_SWAP,
+        [PRIM_ROT] = &&L_PRIM_ROT,
+        [PRIM_JMP] = &&L_PRIM_JMP,
+        [PRIM_JMP0] = &&L_PRIM_JMP0,
+        [PRIM_TICK] = CHECKED_ONLY(L_PRIM_TICK),
+        [PRIM_COMMENT] = CHECKED_ONLY(L_PRIM_COMMENT),
+        [PRIM_PUSHR] = &&L_PRIM_PUSHR,
+        [PRIM_POPR] = &&L_PRIM_POPR,
+        [PRIM_EQUAL] = &&L_PRIM_EQUAL,
+        [PRIM_SYS] = CHECKED_ONLY(L_PRIM_SYS),
+        [PRIM_PICK] = &&L_PRIM_PICK,
+        [PRIM_COMMA] = &&L_PRIM_COMMA,
+        [PRIM_KEY] = CHECKED_ONLY(L_PRIM_KEY),
+        [PRIM_LITS] = &&L_PRIM_LITS,
+        [PRIM_LEN] = &&L_PRIM_LEN,
+        [PRIM_AND] = &&L_PRIM_AND,
+        [PRIM_OR] = &&L_PRIM_OR,
+        [PRIM_XOR] = &&L_PRIM_XOR,
+        [PRIM_SHL] = &&L_PRIM_SHL,
+        [PRIM_SHR] = &&L_PRIM_SHR,
+#if ZF_ENABLE_JIT
+        [PRIM_JIT] = CHECKED_ONLY(L_PRIM_JIT),
+#endif
+#if ZF_ENABLE_AOT
+        [PRIM_AOT] = CHECKED_ONLY(L_PRIM_AOT),
+#endif
+#if ZF_ENABLE_INLINE
+        [PRIM_INLINE] = CHECKED_ONLY(L_PRIM_INLINE),
+        [PRIM_NOINLINE] = CHECKED_ONLY(L_PRIM_NOINLINE),
+#endif
+#if ZF_ENABLE_TASKS
+        [PRIM_PAUSE] = CHECKED_ONLY(L_PRIM_PAUSE),
+#endif
+#if ZF_ENABLE_CHANNELS
+        [PRIM_CHAN_SEND] = CHECKED_ONLY(L_PRIM_CHAN_SEND),
+        [PRIM_CHAN_RECV] = CHECKED_ONLY(L_PRIM_CHAN_RECV),
+        [PRIM_CHAN_TRY_RECV] = CHECKED_ONLY(L_PRIM_CHAN_TRY_RECV),
+#endif
+#if ZF_ENABLE_FUSION
+        [PRIM_LIT_ADD] = &&L_PRIM_LIT_ADD,
+        [PRIM_LIT_SUB] = &&L_PRIM_LIT_SUB,
+        [PRIM_LIT_MUL] = &&L_PRIM_LIT_MUL,
+        [PRIM_LIT_PICK] = &&L_PRIM_LIT_PICK,
+        [PRIM_LIT_PICKR] = &&L_PRIM_LIT_PICKR,
+        [PRIM_2DUP] = &&L_PRIM_2DUP,
+        [PRIM_EQ_JMP0] = &&L_PRIM_EQ_JMP0,
+        [PRIM_LTZ_JMP0] = &&L_PRIM_LTZ_JMP0,
+#endif
+        [PRIM_DO] = &&L_PRIM_DO,
+        [PRIM_LOOP] = &&L_PRIM_LOOP,
+        [PRIM_LOOPP] = &&L_PRIM_LOOPP,
+        [PRIM_I] = &&L_PRIM_I,
+        [PRIM_J] = &&L_PRIM_J,
+        [PRIM_LEAVE] = CHECKED_ONLY(L_PRIM_LEAVE),
+        [PRIM_UNLOOP] = &&L_PRIM_UNLOOP,
+    };
+#endif
+
+    LOAD();
+#if RUN_VERIFIED
+    ctx->verify_dropped = 0;
+#endif
+
+    for (;;)
+    {
+        FETCH();
+
+#if ZF_ENABLE_COMPUTED_GOTO
+        goto *prim_labels[code];
+#else
+        switch ((zf_prim)code)
+#endif
+        {
+#if !RUN_VERIFIED
+            PRIM(PRIM_COL)
+                if (input == NULL)
+                {
+                    REQUEST_INPUT(ZF_INPUT_PASS_WORD);
+                }
+                create(input, 0);
+                input = NULL;
+                COMPILING = 1;
+                NEXT;
+#endif
+
+            PRIM(PRIM_LTZ)
+                POP(d1);
+                PUSH(d1 < 0);
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_SEMICOL)
+                dict_add_op(PRIM_EXIT);
+#if ZF_ENABLE_FUSION
+                fuse(word_xt(LATEST));
+#endif
+#if ZF_ENABLE_VERIFY
+                verify(word_xt(LATEST), HERE);
+#endif
+                trace("\n===");
+                COMPILING = 0;
+                NEXT;
+#endif
+
+            PRIM(PRIM_LIT)
+                OPERAND(d1);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_EXIT)
+                POPR(d1);
+                ctx->ip = d1;
+#if RUN_VERIFIED
+                if (rsp == rbase)
+                {
+                    SAVE();
+                    return;
+                }
+#endif
+                NEXT;
+
+            PRIM(PRIM_LEN)
+                POP(len);
+                POP(addr);
+                if (IS_USERVAR(addr))
+                {
+                    SAVE();
+                }
+                PUSH(peek(addr, &d1, len));
+                NEXT;
+
+            PRIM(PRIM_PEEK)
+                POP(len);
+                POP(addr);
+                if (IS_USERVAR(addr))
+                {
+                    SAVE();
+                }
+                peek(addr, &d1, len);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_POKE)
+                POP(d2);
+                POP(addr);
+                POP(d1);
+                if (IS_USERVAR(addr))
+                {
+                    SAVE();
+                    poke(addr, d1, d2);
+#if RUN_VERIFIED
+                    /* The stack pointers may have been changed */
+                    return;
+#endif
+                    LOAD();
+                    NEXT;
+                }
+                poke(addr, d1, d2);
+                VERIFIED_WRITE();
+                NEXT;
+
+            PRIM(PRIM_SWAP)
+                POP(d1);
+                POP(d2);
+                PUSH(d1);
+                PUSH(d2);
+                NEXT;
+
+            PRIM(PRIM_ROT)
+                POP(d1);
+                POP(d2);
+                POP(d3);
+                PUSH(d2);
+                PUSH(d1);
+                PUSH(d3);
+                NEXT;
+
+            PRIM(PRIM_DROP)
+                POP(d1);
+                NEXT;
+
+            PRIM(PRIM_DUP)
+                POP(d1);
+                PUSH(d1);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_ADD)
+                POP(d1);
+                POP(d2);
+                PUSH(d1 + d2);
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_SYS)
+                POP(d1);
+                SAVE();
+                ctx->input_state = zf_host_sys((zf_syscall_id)d1, input);
+                input = NULL;
+                LOAD();
+#if ZF_ENABLE_YIELD
+                if (ctx->input_state == ZF_INPUT_SUSPEND)
+                {
+                    /* Park after the syscall until the host resumes */
+                    ctx->input_state = ZF_INPUT_INTERPRET;
+                    ctx->yielded = 1;
+                    SAVE();
+                    return;
+                }
+#endif
+                if (ctx->input_state != ZF_INPUT_INTERPRET)
+                {
+                    PUSH(d1); /* re-push id to resume */
+                    SAVE();
+                    ctx->ip = ip_org;
+                    return;
+                }
+                NEXT;
+#endif
+
+            PRIM(PRIM_PICK)
+                POP(addr);
+                PICK(d1, addr);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_PICKR)
+                POP(addr);
+                PICKR(d1, addr);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_SUB)
+                POP(d1);
+                POP(d2);
+                PUSH(d2 - d1);
+                NEXT;
+
+            PRIM(PRIM_MUL)
+                POP(d1);
+                POP(d2);
+                PUSH(d1 * d2);
+                NEXT;
+
+            PRIM(PRIM_DIV)
+                POP(d2);
+                if (d2 == 0)
+                {
+                    zf_abort(ZF_ABORT_DIVISION_BY_ZERO);
+                }
+                POP(d1);
+                PUSH(d1 / d2);
+                NEXT;
+
+            PRIM(PRIM_MOD)
+                POP(d2);
+                if ((int)d2 == 0)
+                {
+                    zf_abort(ZF_ABORT_DIVISION_BY_ZERO);
+                }
+                POP(d1);
+                PUSH((int)d1 % (int)d2);
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_IMMEDIATE)
+                make_immediate();
+                NEXT;
+#endif
+
+#if ZF_ENABLE_INLINE && !RUN_VERIFIED
+            PRIM(PRIM_INLINE)
+                mark_inline(1);
+                NEXT;
+
+            PRIM(PRIM_NOINLINE)
+                mark_inline(0);
+                NEXT;
+#endif
+
+#if ZF_ENABLE_TASKS && !RUN_VERIFIED
+            PRIM(PRIM_PAUSE)
+                SAVE();
+#if ZF_ENABLE_CHANNELS
+                ctx->chan_waits = 0;
+#endif
+                task_switch(task_next());
+                LOAD();
+                NEXT;
+#endif
+
+#if ZF_ENABLE_CHANNELS && !RUN_VERIFIED
+            PRIM(PRIM_CHAN_SEND)
+                POP(addr);
+                POP(d1);
+                if (!zf_chan_send(chan_get(addr), d1))
+                {
+                    PUSH(d1);
+                    PUSH(addr);
+                    CHAN_WAIT();
+                }
+                ctx->chan_waits = 0;
+                NEXT;
+
+            PRIM(PRIM_CHAN_RECV)
+                POP(addr);
+                if (!zf_chan_recv(chan_get(addr), &d1))
+                {
+                    PUSH(addr);
+                    CHAN_WAIT();
+                }
+                ctx->chan_waits = 0;
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_CHAN_TRY_RECV)
+                POP(addr);
+                if (zf_chan_recv(chan_get(addr), &d1))
+                {
+                    ctx->chan_waits = 0;
+                    PUSH(d1);
+                    PUSH(1);
+                }
+                else
+                {
+                    PUSH(0);
+                }
+                NEXT;
+#endif
+
+            PRIM(PRIM_JMP)
+                OPERAND(d1);
+                trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+                ctx->ip = d1;
+                NEXT;
+
+            PRIM(PRIM_JMP0)
+                OPERAND(d1);
+                POP(d2);
+                if (d2 == 0)
+                {
+                    trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+                    ctx->ip = d1;
+                }
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_TICK)
+                if (COMPILING)
+                {
+                    ctx->ip += dict_get_cell(ctx->ip, &d1);
+                    trace("%s/", op_name(d1));
+                    PUSH(d1);
+                    NEXT;
+                }
+                if (input == NULL)
+                {
+                    REQUEST_INPUT(ZF_INPUT_PASS_WORD);
+                }
+                if (find_word(input, strlen(input), &addr, &len))
+                    PUSH(len);
+                else
+                    zf_abort(ZF_ABORT_INTERNAL_ERROR);
+                input = NULL;
+                NEXT;
+#endif
+
+            PRIM(PRIM_COMMA)
+                POP(d2);
+                POP(d1);
+                dict_add_cell_typed(d1, (zf_mem_size)d2);
+                VERIFIED_WRITE();
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_COMMENT)
+                if (!input || input[0] != ')')
+                {
+                    REQUEST_INPUT(ZF_INPUT_PASS_CHAR);
+                }
+                input = NULL;
+                NEXT;
+#endif
+
+            PRIM(PRIM_PUSHR)
+                POP(d1);
+                PUSHR(d1);
+                NEXT;
+
+            PRIM(PRIM_POPR)
+                POPR(d1);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_EQUAL)
+                POP(d1);
+                POP(d2);
+                PUSH(d1 == d2);
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_KEY)
+                if (input == NULL)
+                {
+                    REQUEST_INPUT(ZF_INPUT_PASS_CHAR);
+                }
+                PUSH(input[0]);
+                input = NULL;
+                NEXT;
+#endif
+
+            PRIM(PRIM_LITS)
+                OPERAND(d1);
+                PUSH(ctx->ip);
+                PUSH(d1);
+                ctx->ip += d1;
+                NEXT;
+
+            PRIM(PRIM_AND)
+                POP(d1);
+                POP(d2);
+                PUSH((zf_int)d1 & (zf_int)d2);
+                NEXT;
+
+            PRIM(PRIM_OR)
+                POP(d1);
+                POP(d2);
+                PUSH((zf_int)d1 | (zf_int)d2);
+                NEXT;
+
+            PRIM(PRIM_XOR)
+                POP(d1);
+                POP(d2);
+                PUSH((zf_int)d1 ^ (zf_int)d2);
+                NEXT;
+
+            PRIM(PRIM_SHL)
+                POP(d1);
+                POP(d2);
+                PUSH((zf_int)d2 << (zf_int)d1);
+                NEXT;
+
+            PRIM(PRIM_SHR)
+                POP(d1);
+                POP(d2);
+                PUSH((zf_int)d2 >> (zf_int)d1);
+                NEXT;
+
+            /* Counted loops keep three cells on the return stack: the address
+             * to continue at on 'leave', the limit, and the index on top. The
+             * loop is left when the index reaches or passes the limit */
+
+            PRIM(PRIM_DO)
+                OPERAND(d1);
+                POP(d2);
+                POP(d3);
+                PUSHR(d1);
+                PUSHR(d3);
+                PUSHR(d2);
+                NEXT;
+
+            PRIM(PRIM_LOOP)
+                d2 = 1;
+                goto loop;
+
+            PRIM(PRIM_LOOPP)
+                POP(d2);
+            loop:
+                OPERAND(d1);
+                POPR(d3);
+                d3 += d2;
+                PICKR(d2, 0);
+                if (d3 >= d2)
+                {
+                    POPR(d2);
+                    POPR(d2);
+                    NEXT;
+                }
+                PUSHR(d3);
+                trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+                ctx->ip = d1;
+                NEXT;
+
+            PRIM(PRIM_I)
+                PICKR(d1, 0);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_J)
+                PICKR(d1, 3);
+                PUSH(d1);
+                NEXT;
+
+#if !RUN_VERIFIED
+            PRIM(PRIM_LEAVE)
+                POPR(d1);
+                POPR(d1);
+                POPR(d1);
+                ctx->ip = d1;
+                NEXT;
+#endif
+
+            PRIM(PRIM_UNLOOP)
+                POPR(d1);
+                POPR(d1);
+                POPR(d1);
+                NEXT;
+
+#if ZF_ENABLE_JIT && !RUN_VERIFIED
+            PRIM(PRIM_JIT)
+                POP(addr);
+                v = verify_find(addr);
+                PUSH(v != NULL && jit_compile(v, 0));
+                NEXT;
+#endif
+
+#if ZF_ENABLE_AOT && !RUN_VERIFIED
+            PRIM(PRIM_AOT)
+                OPERAND(d1);
+                CHECK((zf_addr)d1 < zf_aot_count, ZF_ABORT_INTERNAL_ERROR);
+                SAVE();
+                zf_aot_words[(zf_addr)d1]();
+                LOAD();
+                NEXT;
+#endif
+
+#if ZF_ENABLE_FUSION
+            PRIM(PRIM_LIT_ADD)
+                FUSED_OPERAND(PRIM_LIT_ADD, d1);
+                POP(d2);
+                PUSH(d1 + d2);
+                NEXT;
+
+            PRIM(PRIM_LIT_SUB)
+                FUSED_OPERAND(PRIM_LIT_SUB, d1);
+                POP(d2);
+                PUSH(d2 - d1);
+                NEXT;
+
+            PRIM(PRIM_LIT_MUL)
+                FUSED_OPERAND(PRIM_LIT_MUL, d1);
+                POP(d2);
+                PUSH(d1 * d2);
+                NEXT;
+
+            PRIM(PRIM_LIT_PICK)
+                FUSED_OPERAND(PRIM_LIT_PICK, d1);
+                addr = d1;
+                PICK(d1, addr);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_LIT_PICKR)
+                FUSED_OPERAND(PRIM_LIT_PICKR, d1);
+                addr = d1;
+                PICKR(d1, addr);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_2DUP)
+                FUSED_SKIP(PRIM_2DUP);
+                PICK(d1, 1);
+                PUSH(d1);
+                PICK(d1, 1);
+                PUSH(d1);
+                NEXT;
+
+            PRIM(PRIM_EQ_JMP0)
+                FUSED_OPERAND(PRIM_EQ_JMP0, d1);
+                POP(d2);
+                POP(d3);
+                if (!(d2 == d3))
+                {
+                    trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+                    ctx->ip = d1;
+                }
+                NEXT;
+
+            PRIM(PRIM_LTZ_JMP0)
+                FUSED_OPERAND(PRIM_LTZ_JMP0, d1);
+                POP(d2);
+                if (!(d2 < 0))
+                {
+                    trace("ip " ZF_ADDR_FMT "=>" ZF_ADDR_FMT, ctx->ip, (zf_addr)d1);
+                    ctx->ip = d1;
+                }
+                NEXT;
+#endif
+
+#if RUN_VERIFIED
+#if ZF_ENABLE_COMPUTED_GOTO
+        L_unverified:
+#else
+            default:
+#endif
+                ctx->ip = ip_org;
+                SAVE();
+                return;
+#elif !ZF_ENABLE_COMPUTED_GOTO
+            default:
+                zf_abort(ZF_ABORT_INTERNAL_ERROR);
+                break;
+#endif
+        }
+
+    call:
+        trace("%s/" ZF_ADDR_FMT " ", op_name(code), code);
+#if ZF_ENABLE_VERIFY && !RUN_VERIFIED
+        v = verify_entry(code, dsp, rsp);
+        if (v)
+        {
+            PUSHR(ctx->ip);
+            ctx->ip = code;
+            SAVE();
+#if ZF_ENABLE_JIT
+            if (jit_hot(v))
+            {
+                jit_run(v);
+                LOAD();
+                continue;
+            }
+#endif
+            run_verified(rsp - 1);
+            LOAD();
+            continue;
+        }
+#elif ZF_ENABLE_JIT
+        v = verify_find(code);
+        if (jit_hot(v))
+        {
+            PUSHR(ctx->ip);
+            SAVE();
+            if (jit_run(v))
+            {
+                /* Continue in run() after leaving the native code */
+                return;
+            }
+            LOAD();
+            continue;
+        }
+#endif
+        PUSHR(ctx->ip);
+        ctx->ip = code;
+    }
+}
+#if ZF_ENABLE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
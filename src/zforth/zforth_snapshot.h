@@ -0,0 +1,180 @@
+/* Snapshots and forks of contexts. This file is included by zforth.c when
+ * ZF_ENABLE_SNAPSHOT is set.
+ *
+ * A snapshot is an image of a context in a temporary file: the zf_ctx record
+ * with all its tables, followed by the dictionary and both stacks. A fork
+ * maps the image privately, so all forks of a snapshot share its pages until
+ * they write to them, and only fixes up the pointers in its zf_ctx record.
+ * Forking costs an mmap() and a few pages, no matter how large the
+ * dictionary is. */
+
+/* Alignment of the parts of the image */
+
+#define ZF_SNAPSHOT_ALIGN 64
+#define ZF_SNAPSHOT_ROUND(n) (((n) + ZF_SNAPSHOT_ALIGN - 1) & ~(size_t)(ZF_SNAPSHOT_ALIGN - 1))
+
+struct zf_snapshot
+{
+    FILE *file;        /* Temporary file holding the image */
+    size_t size;       /* Size of the image */
+    size_t dict_off;   /* Offset of the dictionary */
+    size_t dstack_off; /* Offset of the data stack */
+    size_t rstack_off; /* Offset of the return stack */
+};
+
+/**
+ * @brief  Take a snapshot of an interpreter context between evaluations.
+ *         Tasks other than task 0 and native code are not part of the
+ *         snapshot
+ * @param  c: Context
+ * @return Snapshot, or NULL if a task other than task 0 is running or the
+ *         image could not be written
+ */
+zf_snapshot *zf_ctx_snapshot(zf_ctx *c)
+{
+    zf_snapshot *s;
+    uint8_t *p;
+    size_t dict_len;
+    zf_cell *dstack = c->dstack;
+    size_t dstack_len = c->dstack_size * sizeof(zf_cell);
+
+#if ZF_ENABLE_TASKS
+    if (c->task != 0)
+    {
+        return NULL;
+    }
+#endif
+#if ZF_ENABLE_TOS_CACHE
+    dstack = c->dstack_mem;
+    dstack_len += sizeof(zf_cell);
+#endif
+    zf_ctx_dump(c, &dict_len);
+
+    s = malloc(sizeof(*s));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    s->dict_off = ZF_SNAPSHOT_ROUND(sizeof(zf_ctx));
+    s->dstack_off = s->dict_off + ZF_SNAPSHOT_ROUND(dict_len);
+    s->rstack_off = s->dstack_off + ZF_SNAPSHOT_ROUND(dstack_len);
+    s->size = s->rstack_off + c->rstack_size * sizeof(zf_cell);
+
+    s->file = tmpfile();
+    if (s->file == NULL || ftruncate(fileno(s->file), s->size) != 0)
+    {
+        zf_snapshot_release(s);
+        return NULL;
+    }
+    p = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(s->file), 0);
+    if (p == MAP_FAILED)
+    {
+        zf_snapshot_release(s);
+        return NULL;
+    }
+    memcpy(p, c, sizeof(zf_ctx));
+    memcpy(p + s->dict_off, c->dict, dict_len);
+    memcpy(p + s->dstack_off, dstack, dstack_len);
+    memcpy(p + s->rstack_off, c->rstack, c->rstack_size * sizeof(zf_cell));
+    munmap(p, s->size);
+    return s;
+}
+
+/**
+ * @brief  Take a snapshot of the current context
+ * @param  None
+ * @return Snapshot, or NULL on failure
+ */
+zf_snapshot *zf_snapshot_take(void)
+{
+    return zf_ctx_snapshot(ctx);
+}
+
+/**
+ * @brief  Create a new context from a snapshot. The fork starts out with the
+ *         dictionary, stacks and user variables of the snapshot, and shares
+ *         the memory of the snapshot until it writes to it. Forks can be
+ *         created from several threads at once
+ * @param  s: Snapshot
+ * @return Context, or NULL if the image could not be mapped
+ */
+zf_ctx *zf_fork(const zf_snapshot *s)
+{
+    uint8_t *p;
+    zf_ctx *c;
+#if ZF_ENABLE_TASKS || ZF_ENABLE_JIT
+    zf_addr i;
+#endif
+
+    p = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(s->file), 0);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    c = (zf_ctx *)p;
+    c->dict = p + s->dict_off;
+    c->uservar = (zf_addr *)c->dict;
+#if ZF_ENABLE_TOS_CACHE
+    c->dstack_mem = (zf_cell *)(p + s->dstack_off);
+    c->dstack = c->dstack_mem + 1;
+#else
+    c->dstack = (zf_cell *)(p + s->dstack_off);
+#endif
+    c->rstack = (zf_cell *)(p + s->rstack_off);
+    c->jmpbuf = NULL;
+    c->src = NULL;
+    c->fork_size = s->size;
+
+#if ZF_ENABLE_TASKS
+    for (i = 1; i < ZF_TASKS_MAX; i++)
+    {
+        c->tasks[i].dstack = NULL;
+    }
+    c->tasks[0].dstack = c->dstack;
+#endif
+#if ZF_ENABLE_YIELD
+    c->steps = 0;
+    c->yielded = 0;
+#endif
+
+    /* The native code stays with the context it was compiled in */
+
+#if ZF_ENABLE_JIT
+    c->jit_arena = NULL;
+    c->jit_here = 0;
+    for (i = 0; i < ZF_VERIFY_SIZE; i++)
+    {
+        if (c->verified[i].jit)
+        {
+            c->verified[i].jit = 0;
+        }
+    }
+#endif
+    return c;
+}
+
+/**
+ * @brief  Release a context created by zf_fork(), with its memory
+ * @param  c: Context
+ * @return None
+ */
+void zf_fork_release(zf_ctx *c)
+{
+    zf_ctx_release(c);
+    munmap(c, c->fork_size);
+}
+
+/**
+ * @brief  Release a snapshot. Forks of the snapshot stay valid
+ * @param  s: Snapshot
+ * @return None
+ */
+void zf_snapshot_release(zf_snapshot *s)
+{
+    if (s->file)
+    {
+        fclose(s->file);
+    }
+    free(s);
+}